@@ -41,34 +41,193 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Lock waits are counted in buckets of 1/8 of a power of two nanoseconds,
+// the last one holds everything from 2^40 ns on
+#define WAIT_SUB_BITS 3
+#define WAIT_BUCKETS ((40 - WAIT_SUB_BITS) << WAIT_SUB_BITS)
+
+// Counters summed over every benchmark process, printed by the parent
+struct benchmark_stats
+{
+        unsigned long long write_usec;
+        unsigned long long write_ops;
+        unsigned long long scan_usec;
+        unsigned long long scan_bytes;
+        unsigned long long mixed_usec;
+        unsigned long long mixed_ops;
+        unsigned long long dtlb_misses;
+        int dtlb_unavailable;
+        unsigned long long lock_waits[WAIT_BUCKETS];
+};
+
+// Exclusive lock waits of this process, added to the shared totals at the end
+static unsigned long long lock_waits[WAIT_BUCKETS];
+
+static unsigned long long now_usec(void)
+{
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static unsigned long long now_nsec(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int wait_bucket(unsigned long long ns)
+{
+        int shift;
+
+        if (ns < (2ULL << WAIT_SUB_BITS))
+                return ns;
+        shift = 63 - __builtin_clzll(ns) - WAIT_SUB_BITS;
+        if (((shift << WAIT_SUB_BITS) + (ns >> shift)) >= WAIT_BUCKETS)
+                return WAIT_BUCKETS - 1;
+        return (shift << WAIT_SUB_BITS) + (ns >> shift);
+}
+
+// Upper bound of the waits counted in a bucket
+static unsigned long long wait_value(int bucket)
+{
+        int shift;
+
+        if (bucket < (2 << WAIT_SUB_BITS))
+                return bucket;
+        shift = (bucket >> WAIT_SUB_BITS) - 1;
+        return ((unsigned long long)(bucket - (shift << WAIT_SUB_BITS) + 1) << shift) - 1;
+}
+
+// Take an object's lock exclusively and count how long that took
+static void timed_lock(int devfd, __u64 oid)
+{
+        unsigned long long start = now_nsec();
+
+        mcontainer_lock(devfd, oid);
+        lock_waits[wait_bucket(now_nsec() - start)]++;
+}
+
+// Count data TLB load misses of this process in user mode, -1 if perf is not permitted
+static int open_dtlb_counter(void)
+{
+        struct perf_event_attr attr;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
 
 int main(int argc, char *argv[])
 {
         // variable initialization
         int i = 0;
         int number_of_processes = 1, number_of_objects = 1024, max_size_of_objects = 8192, number_of_containers = 1;
-        int a, j, cid, size, stat, child_pid, devfd, max_size_of_objects_with_buffer;
+        int hugepage = 0, scan_passes = 0, batch_size = 1, read_pct = -1, use_arena = 0, small = 0, numa_policy = -1, optimistic = 0;
+        int lock_policy = MCONTAINER_LOCK_POLICY_THROUGHPUT;
+        int a, j, k, n, nmap, cid, opt, stat, child_pid = -1, devfd, perf_fd, max_size_of_objects_with_buffer;
         char filename[256];
-        char *mapped_data, *data;
-        unsigned long long msec_time;
+        char *mapped_data, *data, **objects;
+        unsigned long long start_time, sum, misses, waits, below;
+        __u32 seq;
         FILE *fp;
         struct timeval current_time;
+        struct benchmark_stats *stats;
+        struct memory_container_stats module_stats;
+        struct memory_container_cmd *cmds;
+        __s64 *results;
         pid_t *pid;
 
         // takes arguments from command line interface.
-        if (argc < 4)
+        while ((opt = getopt(argc, argv, "AHOSL:N:s:b:r:")) != -1)
         {
-                fprintf(stderr, "Usage: %s number_of_objects max_size_of_objects number_of_processes number_of_containers\n", argv[0]);
+                switch (opt)
+                {
+                case 'A':
+                        use_arena = 1;
+                        break;
+                case 'H':
+                        hugepage = 1;
+                        break;
+                case 'S':
+                        small = 1;
+                        break;
+                case 'O':
+                        optimistic = 1;
+                        break;
+                case 'L':
+                        if (strcmp(optarg, "throughput") == 0)
+                                lock_policy = MCONTAINER_LOCK_POLICY_THROUGHPUT;
+                        else if (strcmp(optarg, "fair") == 0)
+                                lock_policy = MCONTAINER_LOCK_POLICY_FAIR;
+                        else
+                                argc = 0;
+                        break;
+                case 'N':
+                        if (strcmp(optarg, "first-touch") == 0)
+                                numa_policy = MCONTAINER_NUMA_FIRST_TOUCH;
+                        else if (strcmp(optarg, "preferred") == 0)
+                                numa_policy = MCONTAINER_NUMA_PREFERRED;
+                        else if (strcmp(optarg, "interleave") == 0)
+                                numa_policy = MCONTAINER_NUMA_INTERLEAVE;
+                        else
+                                argc = 0;
+                        break;
+                case 's':
+                        scan_passes = atoi(optarg);
+                        break;
+                case 'b':
+                        batch_size = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                        break;
+                case 'r':
+                        read_pct = atoi(optarg) < 0 ? 0 : atoi(optarg) > 100 ? 100 : atoi(optarg);
+                        break;
+                default:
+                        argc = 0;
+                }
+        }
+        if (argc - optind < 4)
+        {
+                fprintf(stderr, "Usage: %s [-A] [-H] [-O] [-S] [-L lock_policy] [-N numa_policy] [-s scan_passes] [-b batch_size] [-r read_percent] number_of_objects max_size_of_objects number_of_processes number_of_containers\n", argv[0]);
+                fprintf(stderr, "  -A  reach objects through one arena mapping instead of a mapping each\n");
+                fprintf(stderr, "  -H  back objects with huge pages\n");
+                fprintf(stderr, "  -O  read without a lock under -r, retrying when a writer got in\n");
+                fprintf(stderr, "  -S  pack objects of up to half a page into shared pages\n");
+                fprintf(stderr, "  -L  hand contended locks over in throughput or fair (FIFO) order\n");
+                fprintf(stderr, "  -N  place object pages first-touch, preferred (node 0) or interleave\n");
+                fprintf(stderr, "  -s  read every object this many times after writing them\n");
+                fprintf(stderr, "  -b  lock, map and unlock this many objects per system call\n");
+                fprintf(stderr, "  -r  then access random objects, this percentage of them read under a shared lock\n");
                 exit(1);
         }
 
-        number_of_objects = atoi(argv[1]);
-        max_size_of_objects = atoi(argv[2]);
-        number_of_processes = atoi(argv[3]);
-        number_of_containers = atoi(argv[4]);
+        number_of_objects = atoi(argv[optind]);
+        max_size_of_objects = atoi(argv[optind + 1]);
+        number_of_processes = atoi(argv[optind + 2]);
+        number_of_containers = atoi(argv[optind + 3]);
 
         max_size_of_objects_with_buffer = max_size_of_objects + 100;
         pid = (pid_t *) calloc(number_of_processes - 1, sizeof(pid_t));
+        objects = (char **) calloc(number_of_objects, sizeof(char *));
+        cmds = (struct memory_container_cmd *) calloc(2 * batch_size, sizeof(struct memory_container_cmd));
+        results = (__s64 *) calloc(2 * batch_size, sizeof(__s64));
+
+        // shared with the children so the parent can report the totals
+        stats = (struct benchmark_stats *) mmap(NULL, sizeof(struct benchmark_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (stats == MAP_FAILED)
+        {
+                fprintf(stderr, "Failed to allocate shared statistics\n");
+                exit(1);
+        }
+        memset(stats, 0, sizeof(struct benchmark_stats));
 
         // open the kernel module to use it
         devfd = open("/dev/mcontainer", O_RDWR);
@@ -102,36 +261,218 @@ int main(int argc, char *argv[])
         // create/link this process to a container.
         cid = getpid() % number_of_containers;
         mcontainer_create(devfd, cid);
+        if (hugepage && mcontainer_set_container_attr(devfd, MCONTAINER_ATTR_HUGEPAGE, 1) < 0)
+        {
+                fprintf(stderr, "Huge pages are not supported by the module\n");
+        }
+
+        if (small && mcontainer_set_container_attr(devfd, MCONTAINER_ATTR_SMALL_OBJECTS, 1) < 0)
+        {
+                fprintf(stderr, "Small objects are not supported by the module\n");
+        }
+        if (optimistic && mcontainer_set_container_attr(devfd, MCONTAINER_ATTR_SEQLOCK, 1) < 0)
+        {
+                fprintf(stderr, "Optimistic reads are not supported by the module\n");
+                optimistic = 0;
+        }
+        if (lock_policy != MCONTAINER_LOCK_POLICY_THROUGHPUT && mcontainer_set_container_attr(devfd, MCONTAINER_ATTR_LOCK_POLICY, lock_policy) < 0)
+        {
+                fprintf(stderr, "Fair locks are not supported by the module\n");
+        }
+        if (numa_policy >= 0 && mcontainer_set_container_attr(devfd, MCONTAINER_ATTR_NUMA_POLICY, numa_policy) < 0)
+        {
+                fprintf(stderr, "NUMA placement is not supported by the module\n");
+        }
+        if (use_arena && mcontainer_arena_map(devfd, number_of_objects, max_size_of_objects) == MAP_FAILED)
+        {
+                fprintf(stderr, "Failed in mcontainer_arena_map()\n");
+                exit(1);
+        }
+
+        perf_fd = open_dtlb_counter();
+        if (perf_fd < 0)
+        {
+                stats->dtlb_unavailable = 1;
+        }
+        else
+        {
+                ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
 
         // Writing to objects
-        for (i = 0; i < number_of_objects; i++)
+        start_time = now_usec();
+        for (i = 0; i < number_of_objects; i += n)
         {
-                mcontainer_lock(devfd, i);
-                mapped_data = (char *)mcontainer_alloc(devfd, i, max_size_of_objects);
+                n = number_of_objects - i < batch_size ? number_of_objects - i : batch_size;
+                if (batch_size > 1)
+                {
+                        // map and lock the whole group with one system call,
+                        // objects in the arena are mapped already unless they
+                        // are packed, which their first mapping does. Objects
+                        // are created before they are locked.
+                        nmap = use_arena && !small ? 0 : n;
+                        for (k = 0; k < n; k++)
+                        {
+                                if (nmap)
+                                {
+                                        cmds[k].op = MCONTAINER_OP_MAP;
+                                        cmds[k].oid = i + k;
+                                        cmds[k].value = max_size_of_objects;
+                                }
+                                cmds[nmap + k].op = MCONTAINER_OP_LOCK;
+                                cmds[nmap + k].oid = i + k;
+                        }
+                        if (mcontainer_batch(devfd, cmds, results, n + nmap) != n + nmap)
+                        {
+                                fprintf(stderr, "Failed in mcontainer_batch()\n");
+                                exit(1);
+                        }
+                        for (k = 0; k < n; k++)
+                        {
+                                if (use_arena)
+                                        objects[i + k] = (char *)mcontainer_arena_ptr(i + k);
+                                else
+                                        objects[i + k] = results[k] < 0 ? NULL : (char *)(unsigned long)results[k];
+                        }
+                }
+                else
+                {
+                        if (!use_arena || small)
+                                objects[i] = (char *)mcontainer_alloc(devfd, i, max_size_of_objects);
+                        if (use_arena && objects[i] != MAP_FAILED)
+                                objects[i] = (char *)mcontainer_arena_ptr(i);
+                        timed_lock(devfd, i);
+                }
+
+                for (k = 0; k < n; k++)
+                {
+                        mapped_data = objects[i + k];
+
+                        // error handling
+                        if (!mapped_data)
+                        {
+                                fprintf(stderr, "Failed in mcontainer_alloc()\n");
+                                exit(1);
+                        }
+
+                        // generate a random number to write into the object.
+                        a = rand() + 1;
+
+                        // starts to write the data to that address.
+                        gettimeofday(&current_time, NULL);
+                        for (j = 0; j < max_size_of_objects_with_buffer - 10; j += sprintf(data + j, "%d", a))
+                        {
+                        }
+                        strncpy(mapped_data, data, max_size_of_objects-1);
+                        mapped_data[max_size_of_objects-1] = '\0';
+
+                        // prints out the result into the log
+                        fprintf(fp, "S\t%d\t%d\t%ld\t%d\t%d\t%s\n", getpid(), cid, current_time.tv_sec * 1000000 + current_time.tv_usec, i + k, max_size_of_objects, mapped_data);
+                        memset(data, 0, max_size_of_objects_with_buffer);
+                }
 
-                // error handling
-                if (!mapped_data)
+                if (batch_size > 1)
+                {
+                        for (k = 0; k < n; k++)
+                        {
+                                cmds[k].op = MCONTAINER_OP_UNLOCK;
+                                cmds[k].oid = i + k;
+                        }
+                        mcontainer_batch(devfd, cmds, results, n);
+                }
+                else
+                {
+                        mcontainer_unlock(devfd, i);
+                }
+        }
+        __sync_fetch_and_add(&stats->write_usec, now_usec() - start_time);
+        __sync_fetch_and_add(&stats->write_ops, 3ULL * number_of_objects);
+
+        // Reading every object back, one cache line at a time
+        start_time = now_usec();
+        sum = 0;
+        for (a = 0; a < scan_passes; a++)
+        {
+                for (i = 0; i < number_of_objects; i++)
+                {
+                        // the library unmaps what it evicts from its cache
+                        if (!use_arena && batch_size <= 1)
+                                objects[i] = (char *)mcontainer_alloc(devfd, i, max_size_of_objects);
+                        for (j = 0; j < max_size_of_objects; j += 64)
+                        {
+                                sum += ((volatile char *)objects[i])[j];
+                        }
+                }
+        }
+        __sync_fetch_and_add(&stats->scan_usec, now_usec() - start_time);
+        __sync_fetch_and_add(&stats->scan_bytes, (unsigned long long)scan_passes * number_of_objects * max_size_of_objects);
+
+        // Random reads under a shared lock mixed with writes under an exclusive one
+        start_time = now_usec();
+        for (k = 0; read_pct >= 0 && k < number_of_objects; k++)
+        {
+                i = rand() % number_of_objects;
+                // a hot object is a cache hit in the library, not another mmap
+                if (!use_arena)
+                        objects[i] = (char *)mcontainer_alloc(devfd, i, max_size_of_objects);
+                if (objects[i] == MAP_FAILED)
                 {
                         fprintf(stderr, "Failed in mcontainer_alloc()\n");
                         exit(1);
                 }
+                if (rand() % 100 < read_pct)
+                {
+                        if (optimistic && mcontainer_read_begin(devfd, i, &seq) == 0)
+                        {
+                                // read a copy, a writer may tear it
+                                do
+                                {
+                                        memcpy(data, objects[i], max_size_of_objects);
+                                } while (mcontainer_read_retry(devfd, i, seq) && mcontainer_read_begin(devfd, i, &seq) == 0);
+                                sum += strnlen(data, max_size_of_objects);
+                        }
+                        else
+                        {
+                                mcontainer_rdlock(devfd, i);
+                                sum += strlen(objects[i]);
+                                mcontainer_rdunlock(devfd, i);
+                        }
+                }
+                else
+                {
+                        timed_lock(devfd, i);
+                        gettimeofday(&current_time, NULL);
+                        a = rand() + 1;
+                        for (j = 0; j < max_size_of_objects_with_buffer - 10; j += sprintf(data + j, "%d", a))
+                        {
+                        }
+                        strncpy(objects[i], data, max_size_of_objects-1);
+                        objects[i][max_size_of_objects-1] = '\0';
+                        fprintf(fp, "S\t%d\t%d\t%ld\t%d\t%d\t%s\n", getpid(), cid, current_time.tv_sec * 1000000 + current_time.tv_usec, i, max_size_of_objects, objects[i]);
+                        memset(data, 0, max_size_of_objects_with_buffer);
+                        mcontainer_unlock(devfd, i);
+                }
+        }
+        if (read_pct >= 0)
+        {
+                __sync_fetch_and_add(&stats->mixed_usec, now_usec() - start_time);
+                __sync_fetch_and_add(&stats->mixed_ops, (unsigned long long)number_of_objects);
+        }
 
-                // generate a random number to write into the object.
-                a = rand() + 1;
+        for (n = 0; n < WAIT_BUCKETS; n++)
+        {
+                if (lock_waits[n])
+                        __sync_fetch_and_add(&stats->lock_waits[n], lock_waits[n]);
+        }
 
-                // starts to write the data to that address.
-                gettimeofday(&current_time, NULL);
-                for (j = 0; j < max_size_of_objects_with_buffer - 10; j = strlen(data))
+        if (perf_fd >= 0)
+        {
+                ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(perf_fd, &misses, sizeof(misses)) == sizeof(misses))
                 {
-                        sprintf(data, "%s%d", data, a);
+                        __sync_fetch_and_add(&stats->dtlb_misses, misses);
                 }
-                strncpy(mapped_data, data, max_size_of_objects-1);
-                mapped_data[max_size_of_objects-1] = '\0';
-
-                // prints out the result into the log
-                fprintf(fp, "S\t%d\t%d\t%ld\t%d\t%d\t%s\n", getpid(), cid, current_time.tv_sec * 1000000 + current_time.tv_usec, i, max_size_of_objects, mapped_data);
-                mcontainer_unlock(devfd, i);
-                memset(data, 0, max_size_of_objects_with_buffer);
+                close(perf_fd);
         }
 
         // try delete something
@@ -152,8 +493,60 @@ int main(int argc, char *argv[])
                 {
                         waitpid(pid[i], &stat, 0);
                 }
+
+                // per process averages, so runs with different task counts compare
+                printf("hugepage=%d arena=%d small=%d numa=%d batch=%d write_usec=%llu", hugepage, use_arena, small, numa_policy, batch_size, stats->write_usec / number_of_processes);
+                printf(" ops_per_sec=%.0f", stats->write_usec ? stats->write_ops * 1000000.0 / stats->write_usec : 0.0);
+                if (scan_passes > 0)
+                {
+                        printf(" scan_MBps=%.1f", stats->scan_usec ? (double)stats->scan_bytes / stats->scan_usec : 0.0);
+                }
+                if (read_pct >= 0)
+                {
+                        printf(" read_pct=%d optimistic=%d mixed_ops_per_sec=%.0f", read_pct, optimistic, stats->mixed_usec ? stats->mixed_ops * 1000000.0 / stats->mixed_usec : 0.0);
+                }
+                // 99th percentile of the time exclusive lock calls took, over all tasks
+                for (waits = 0, n = 0; n < WAIT_BUCKETS; n++)
+                {
+                        waits += stats->lock_waits[n];
+                }
+                for (below = 0, n = 0; waits && n < WAIT_BUCKETS; n++)
+                {
+                        below += stats->lock_waits[n];
+                        if (below * 100 >= waits * 99)
+                                break;
+                }
+                printf(" lock_policy=%s lock_wait_p99_ns=%llu", lock_policy == MCONTAINER_LOCK_POLICY_FAIR ? "fair" : "throughput", waits ? wait_value(n) : 0ULL);
+                // pages still held by objects once every task is done
+                devfd = open("/dev/mcontainer", O_RDWR);
+                if (devfd >= 0 && mcontainer_get_stats(devfd, &module_stats) == 0)
+                {
+                        printf(" resident_pages=%llu", (unsigned long long)module_stats.pages);
+                        if (module_stats.compressed_pages)
+                                printf(" compressed_pages=%llu compressed_bytes=%llu", (unsigned long long)module_stats.compressed_pages, (unsigned long long)module_stats.compressed_bytes);
+                        for (n = 0; n < (int)module_stats.nr_nodes && n < MCONTAINER_STATS_NODES; n++)
+                        {
+                                if (module_stats.node_bytes[n])
+                                        printf(" node%d_bytes=%llu", n, (unsigned long long)module_stats.node_bytes[n]);
+                        }
+                }
+                if (devfd >= 0)
+                {
+                        close(devfd);
+                }
+                if (stats->dtlb_unavailable)
+                {
+                        printf(" dtlb_load_misses=n/a\n");
+                }
+                else
+                {
+                        printf(" dtlb_load_misses=%llu\n", stats->dtlb_misses / number_of_processes);
+                }
         }
         free(pid);
         free(data);
+        free(objects);
+        free(cmds);
+        free(results);
         return 0;
 }
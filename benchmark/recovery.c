@@ -0,0 +1,158 @@
+//////////////////////////////////////////////////////////////////////
+//                      North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Author:  Hung-Wei Tseng, Yu-Chia Liu
+//
+//   Description:
+//     Recovery of Locks Held by Killed Tasks
+//
+////////////////////////////////////////////////////////////////////////
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mcontainer.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/wait.h>
+
+#define RECOVERY_TIMEOUT_NS 1000000000ULL
+
+// A child takes object 0 exclusively and object 1 shared. It is either
+// killed while it holds both, or deletes itself from the container and
+// stays alive. The device stays open in the parent, so the locks have to be
+// released when the child exits or leaves, not when the file is closed.
+int check_recovery(int devfd, int cid, int delete)
+{
+    const char *how = delete ? "deleted" : "killed";
+    int error = 0, pipefd[2];
+    pid_t child_pid;
+    char ready;
+
+    if (pipe(pipefd) < 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    child_pid = fork();
+    if (child_pid == 0)
+    {
+        mcontainer_create(devfd, cid);
+        if (mcontainer_lock(devfd, 0) != 0 || mcontainer_rdlock(devfd, 1) != 0)
+        {
+            exit(1);
+        }
+        if (delete && mcontainer_delete(devfd) != 0)
+        {
+            exit(1);
+        }
+        ready = 1;
+        if (write(pipefd[1], &ready, 1) != 1)
+        {
+            exit(1);
+        }
+        for (;;)
+        {
+            pause();
+        }
+    }
+    else if (child_pid < 0)
+    {
+        perror("fork");
+        exit(1);
+    }
+
+    if (read(pipefd[0], &ready, 1) != 1)
+    {
+        fprintf(stderr, "Child %d failed to take its locks\n", child_pid);
+        exit(1);
+    }
+    if (!delete)
+    {
+        kill(child_pid, SIGKILL);
+        waitpid(child_pid, NULL, 0);
+    }
+
+    mcontainer_create(devfd, cid);
+    if (mcontainer_timedlock(devfd, 0, RECOVERY_TIMEOUT_NS) != 0)
+    {
+        fprintf(stderr, "Exclusive lock of the %s child was not released: %s\n", how, strerror(errno));
+        error++;
+    }
+    else
+    {
+        mcontainer_unlock(devfd, 0);
+    }
+    if (mcontainer_timedlock(devfd, 1, RECOVERY_TIMEOUT_NS) != 0)
+    {
+        fprintf(stderr, "Shared lock of the %s child was not released: %s\n", how, strerror(errno));
+        error++;
+    }
+    else
+    {
+        mcontainer_unlock(devfd, 1);
+    }
+    mcontainer_delete(devfd);
+
+    if (delete)
+    {
+        kill(child_pid, SIGKILL);
+        waitpid(child_pid, NULL, 0);
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return error;
+}
+
+int main(int argc, char *argv[])
+{
+    int devfd, cid = 0, error = 0;
+
+    if (argc > 1)
+    {
+        cid = atoi(argv[1]);
+    }
+
+    devfd = open("/dev/mcontainer", O_RDWR);
+    if (devfd < 0)
+    {
+        fprintf(stderr, "Device open failed");
+        exit(1);
+    }
+
+    error += check_recovery(devfd, cid, 0);
+    error += check_recovery(devfd, cid, 1);
+
+    if (error == 0)
+    {
+        fprintf(stderr, "Container %d Lock recovery Pass\n", cid);
+    }
+
+    close(devfd);
+    return error != 0;
+}
@@ -0,0 +1,127 @@
+//////////////////////////////////////////////////////////////////////
+//                      North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Author:  Hung-Wei Tseng, Yu-Chia Liu
+//
+//   Description:
+//     Sequence Counts of Objects Locked Before They Exist
+//
+////////////////////////////////////////////////////////////////////////
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mcontainer.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+
+#define SEQLOCK_TIMEOUT_SEC 5
+
+static void timed_out(int sig)
+{
+    (void)sig;
+    fprintf(stderr, "mcontainer_read_begin() did not return, the sequence count stayed odd\n");
+    _exit(1);
+}
+
+// Locks the object, gives it the seqlock attribute and creates it while the
+// lock is held, writes it and unlocks it. A read afterwards has to start
+// right away and see a consistent copy.
+static int check_object(int devfd, __u64 oid, int object_attr)
+{
+    char copy[64], *data;
+    __u32 seq;
+
+    if (mcontainer_lock(devfd, oid) != 0)
+    {
+        perror("mcontainer_lock");
+        return 1;
+    }
+    if (object_attr && mcontainer_set_object_attr(devfd, oid, MCONTAINER_ATTR_SEQLOCK, 1) != 0)
+    {
+        perror("mcontainer_set_object_attr");
+        return 1;
+    }
+    data = (char *)mcontainer_alloc(devfd, oid, getpagesize());
+    if (data == NULL || data == MAP_FAILED)
+    {
+        perror("mcontainer_alloc");
+        return 1;
+    }
+    strcpy(data, "written under the lock");
+    mcontainer_unlock(devfd, oid);
+
+    alarm(SEQLOCK_TIMEOUT_SEC);
+    if (mcontainer_read_begin(devfd, oid, &seq) != 0)
+    {
+        perror("mcontainer_read_begin");
+        return 1;
+    }
+    memcpy(copy, data, sizeof(copy));
+    alarm(0);
+    if (mcontainer_read_retry(devfd, oid, seq) || strcmp(copy, "written under the lock") != 0)
+    {
+        fprintf(stderr, "Object %llu read back inconsistent\n", oid);
+        return 1;
+    }
+    mcontainer_free(devfd, oid);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int devfd, cid = 0, error = 0;
+
+    if (argc > 1)
+    {
+        cid = atoi(argv[1]);
+    }
+
+    devfd = open("/dev/mcontainer", O_RDWR);
+    if (devfd < 0)
+    {
+        fprintf(stderr, "Device open failed");
+        exit(1);
+    }
+    signal(SIGALRM, timed_out);
+    mcontainer_create(devfd, cid);
+
+    // attribute inherited from the container when the object is created
+    mcontainer_set_container_attr(devfd, MCONTAINER_ATTR_SEQLOCK, 1);
+    error += check_object(devfd, 0, 0);
+    // attribute set on the object while its lock is held
+    mcontainer_set_container_attr(devfd, MCONTAINER_ATTR_SEQLOCK, 0);
+    error += check_object(devfd, 1, 1);
+
+    if (error == 0)
+    {
+        fprintf(stderr, "Container %d Seqlock Pass\n", cid);
+    }
+
+    mcontainer_delete(devfd);
+    close(devfd);
+    return error != 0;
+}
@@ -39,12 +39,188 @@ struct memory_container_cmd
     __u64 op;
     __u64 cid;
     __u64 oid;
+    __u64 value;
+    // relative timeout of MCONTAINER_IOCTL_TIMEDLOCK in nanoseconds
+    __u64 timeout;
 };
 
+// Attributes selected by op in MCONTAINER_IOCTL_SET_CONTAINER_ATTR, which sets
+// the default for objects created afterwards, and MCONTAINER_IOCTL_SET_OBJECT_ATTR,
+// which sets one object before it is first mapped. MCONTAINER_IOCTL_GET_CONTAINER_ATTR
+// returns the container's default.
+#define MCONTAINER_ATTR_HUGEPAGE 1
+// Objects of at most half a page placed with MCONTAINER_IOCTL_SMALL_ALLOC share
+// pages with other small objects, the ioctl returns the offset in the page.
+#define MCONTAINER_ATTR_SMALL_OBJECTS 2
+// Node placement of an object's pages, one of MCONTAINER_NUMA_*. First touch
+// takes the node of the faulting CPU, preferred the node set with
+// MCONTAINER_ATTR_NUMA_NODE (0 unless set), interleave spreads the pages over
+// all nodes with memory.
+#define MCONTAINER_ATTR_NUMA_POLICY 3
+#define MCONTAINER_ATTR_NUMA_NODE 4
+
+// Writers of an object with the seqlock attribute keep the sequence count in
+// its header odd while they hold the lock exclusively, so that readers can copy
+// the object without locking and retry when the count moved. Set it before the
+// object is first used. While another task holds the lock the header flag
+// follows once that task unlocks.
+#define MCONTAINER_ATTR_SEQLOCK 5
+// How the lock word of an object treats writers that have to wait, one of
+// MCONTAINER_LOCK_POLICY_*. Throughput wakes all waiters on unlock and lets
+// whoever comes first take the lock. Fair queues writers in arrival order and
+// hands the lock straight to the first one, at the cost of a system call for
+// every unlock while writers wait. Readers wait for queued writers either way.
+// Both spin briefly while the holder runs on another CPU. Set it before the
+// object is first locked.
+#define MCONTAINER_ATTR_LOCK_POLICY 6
+
+#define MCONTAINER_NUMA_FIRST_TOUCH 0
+#define MCONTAINER_NUMA_PREFERRED 1
+#define MCONTAINER_NUMA_INTERLEAVE 2
+
+#define MCONTAINER_LOCK_POLICY_THROUGHPUT 0
+#define MCONTAINER_LOCK_POLICY_FAIR 1
+
+// Limits selected by op in MCONTAINER_IOCTL_SET_LIMIT, value 0 lifts the
+// limit. An object is charged its full size once it gets it, with its first
+// mapping or MCONTAINER_IOCTL_SMALL_ALLOC, which fail with ENOMEM over the
+// limit. An arena slot over the limit raises SIGBUS instead.
+#define MCONTAINER_LIMIT_OBJECTS 1
+#define MCONTAINER_LIMIT_BYTES 2
+
+// Every object has a header slot in its container's header pages. The library
+// maps them at MCONTAINER_MMAP_HEADER, slot oid lives at byte offset
+// oid * sizeof(struct memory_container_header) of that mapping. generation
+// changes whenever the object is freed, mappings taken before are stale. flags
+// holds MCONTAINER_HEADER_* set by the module, seq the sequence count. offset
+// is the byte offset of a packed small object in its page, valid once
+// MCONTAINER_HEADER_PACKED is set.
+struct memory_container_header
+{
+    __u32 lock;
+    __u32 generation;
+    __u32 flags;
+    __u32 seq;
+    __u32 offset;
+    __u32 reserved[11];
+};
+
+#define MCONTAINER_HEADER_SEQLOCK 0x1u
+#define MCONTAINER_HEADER_FAIR 0x2u
+#define MCONTAINER_HEADER_PACKED 0x4u
+
+// The lock word is 0 when free. Held exclusively it stores the owner's thread
+// id, held shared it has MCONTAINER_LOCK_SHARED set and counts the readers in
+// the same bits. MCONTAINER_LOCK_WAITERS is set once a waiter sleeps in the
+// kernel, an unlock that would have to wake it goes through the kernel.
+// MCONTAINER_LOCK_WRITER_WAITING keeps new readers out while a writer waits.
+#define MCONTAINER_LOCK_WAITERS 0x80000000u
+#define MCONTAINER_LOCK_SHARED 0x40000000u
+#define MCONTAINER_LOCK_WRITER_WAITING 0x20000000u
+#define MCONTAINER_LOCK_OWNER_MASK 0x1fffffffu
+
+// mmap offsets are in pages. Below MCONTAINER_MMAP_HEADER the offset is the
+// OID, from MCONTAINER_MMAP_HEADER on it selects header pages of the container.
+// MCONTAINER_MMAP_ARENA maps all objects in one window, each OID owns a slot
+// of 2^order pages at oid << order, where order is stored at
+// MCONTAINER_ARENA_ORDER_SHIFT of the offset. A slot creates its object when
+// first touched, an existing object shows its first slot worth of pages and a
+// packed small object sits at its offset inside the slot. MCONTAINER_MMAP_HOLDS
+// maps the calling task's hold log, one page.
+#define MCONTAINER_MMAP_TYPE_SHIFT 40
+#define MCONTAINER_MMAP_HEADER (1ULL << MCONTAINER_MMAP_TYPE_SHIFT)
+#define MCONTAINER_MMAP_ARENA (2ULL << MCONTAINER_MMAP_TYPE_SHIFT)
+#define MCONTAINER_MMAP_HOLDS (3ULL << MCONTAINER_MMAP_TYPE_SHIFT)
+#define MCONTAINER_ARENA_ORDER_SHIFT 32
+
+// The lock word only counts readers, so every task logs the objects it holds
+// shared in a hold log of its own. A slot stores the OID plus one, 0 is free.
+// The log is written after the lock is taken and cleared before it is
+// released. When the task dies or leaves its container by moving to another
+// one, the module releases the holds still logged.
+#define MCONTAINER_HOLDS_MAX 512
+
+struct memory_container_holds
+{
+    __u64 oid[MCONTAINER_HOLDS_MAX];
+};
+
+// A batch runs count commands from cmds in order and stores each result, or
+// the mapped address for MCONTAINER_OP_MAP, in results. The op of every
+// command selects what it does, MAP uses value as the size and TIMEDLOCK
+// the timeout. The ioctl returns how many commands ran, a signal during a
+// lock stops the batch early. count is at most MCONTAINER_BATCH_MAX, more
+// fail with E2BIG. The mappings MAP creates belong to the caller, who unmaps
+// them with munmap() on the address rounded down to the page.
+#define MCONTAINER_BATCH_MAX 4096
+
+struct memory_container_batch
+{
+    __u64 count;
+    __u64 cmds;
+    __u64 results;
+};
+
+// Module wide counters. pages are the 4 KB pages objects hold right now, the
+// reclaimed counters sum up what torn down containers gave back. node_bytes
+// splits what objects hold by NUMA node, for the first nr_nodes node ids.
+// compressed_pages are pages of cold objects the module compressed under
+// memory pressure, into compressed_bytes, they are not part of pages.
+#define MCONTAINER_STATS_NODES 64
+
+struct memory_container_stats
+{
+    __u64 containers;
+    __u64 objects;
+    __u64 pages;
+    __u64 reclaimed_containers;
+    __u64 reclaimed_pages;
+    __u64 compressed_pages;
+    __u64 compressed_bytes;
+    __u64 nr_nodes;
+    __u64 node_bytes[MCONTAINER_STATS_NODES];
+};
+
+// A byte range [offset, offset + length) of one object for
+// MCONTAINER_IOCTL_LOCK_RANGE. Ranges of an object exclude each other when
+// they overlap and hold the object's lock word shared, so a lock of the whole
+// object waits for them. Only the exact range locked can be unlocked, by the
+// same thread. Range holders do not move the seqlock count, so objects with
+// MCONTAINER_ATTR_SEQLOCK refuse range locks with EINVAL, and the attribute
+// cannot be set with EBUSY while ranges are held.
+struct memory_container_range
+{
+    __u64 oid;
+    __u64 offset;
+    __u64 length;
+};
+
+#define MCONTAINER_OP_LOCK 1
+#define MCONTAINER_OP_UNLOCK 2
+#define MCONTAINER_OP_FREE 3
+#define MCONTAINER_OP_MAP 4
+#define MCONTAINER_OP_RDLOCK 5
+#define MCONTAINER_OP_RDUNLOCK 6
+#define MCONTAINER_OP_TRYLOCK 7
+#define MCONTAINER_OP_TIMEDLOCK 8
+
 #define MCONTAINER_IOCTL_DELETE _IOWR('N', 0x45, struct memory_container_cmd)
 #define MCONTAINER_IOCTL_CREATE _IOWR('N', 0x46, struct memory_container_cmd)
 #define MCONTAINER_IOCTL_LOCK _IOWR('N', 0x47, struct memory_container_cmd)
 #define MCONTAINER_IOCTL_UNLOCK _IOWR('N', 0x48, struct memory_container_cmd)
 #define MCONTAINER_IOCTL_FREE _IOWR('N', 0x49, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_SET_CONTAINER_ATTR _IOWR('N', 0x4a, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_SET_OBJECT_ATTR _IOWR('N', 0x4b, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_BATCH _IOWR('N', 0x4c, struct memory_container_batch)
+#define MCONTAINER_IOCTL_RDLOCK _IOWR('N', 0x4d, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_RDUNLOCK _IOWR('N', 0x4e, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_TRYLOCK _IOWR('N', 0x4f, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_TIMEDLOCK _IOWR('N', 0x50, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_SMALL_ALLOC _IOWR('N', 0x51, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_GET_STATS _IOR('N', 0x52, struct memory_container_stats)
+#define MCONTAINER_IOCTL_SET_LIMIT _IOWR('N', 0x53, struct memory_container_cmd)
+#define MCONTAINER_IOCTL_LOCK_RANGE _IOWR('N', 0x54, struct memory_container_range)
+#define MCONTAINER_IOCTL_UNLOCK_RANGE _IOWR('N', 0x55, struct memory_container_range)
+#define MCONTAINER_IOCTL_GET_CONTAINER_ATTR _IOWR('N', 0x56, struct memory_container_cmd)
 
 #endif
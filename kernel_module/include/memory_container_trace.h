@@ -0,0 +1,198 @@
+//////////////////////////////////////////////////////////////////////
+//                      North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Author:  Hung-Wei Tseng, Yu-Chia Liu
+//
+//   Description:
+//     Tracepoints of Memory Container, under events/memory_container in
+//     tracefs. Every event carries the CID, the OID, the PID of the task,
+//     a size in bytes and the time waited in ns where they apply.
+//
+////////////////////////////////////////////////////////////////////////
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM memory_container
+
+#if !defined(MEMORY_CONTAINER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define MEMORY_CONTAINER_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/sched.h>
+
+// Events on a whole container, size is what its objects hold
+DECLARE_EVENT_CLASS(mcontainer_container,
+
+        TP_PROTO(__u64 cid, unsigned long size),
+
+        TP_ARGS(cid, size),
+
+        TP_STRUCT__entry(
+                __field(__u64, cid)
+                __field(pid_t, pid)
+                __field(unsigned long, size)
+        ),
+
+        TP_fast_assign(
+                __entry->cid = cid;
+                __entry->pid = current->pid;
+                __entry->size = size;
+        ),
+
+        TP_printk("cid=%llu pid=%d size=%lu", __entry->cid, __entry->pid, __entry->size)
+);
+
+DEFINE_EVENT(mcontainer_container, mcontainer_container_create,
+        TP_PROTO(__u64 cid, unsigned long size),
+        TP_ARGS(cid, size)
+);
+
+DEFINE_EVENT(mcontainer_container, mcontainer_container_destroy,
+        TP_PROTO(__u64 cid, unsigned long size),
+        TP_ARGS(cid, size)
+);
+
+// A task joins or leaves a container. pid is the task's, a task that died is
+// taken out of its container by another one.
+DECLARE_EVENT_CLASS(mcontainer_task,
+
+        TP_PROTO(__u64 cid, pid_t pid),
+
+        TP_ARGS(cid, pid),
+
+        TP_STRUCT__entry(
+                __field(__u64, cid)
+                __field(pid_t, pid)
+        ),
+
+        TP_fast_assign(
+                __entry->cid = cid;
+                __entry->pid = pid;
+        ),
+
+        TP_printk("cid=%llu pid=%d", __entry->cid, __entry->pid)
+);
+
+DEFINE_EVENT(mcontainer_task, mcontainer_task_join,
+        TP_PROTO(__u64 cid, pid_t pid),
+        TP_ARGS(cid, pid)
+);
+
+DEFINE_EVENT(mcontainer_task, mcontainer_task_leave,
+        TP_PROTO(__u64 cid, pid_t pid),
+        TP_ARGS(cid, pid)
+);
+
+// Events on one object, size is the mapping or object size
+DECLARE_EVENT_CLASS(mcontainer_object,
+
+        TP_PROTO(__u64 cid, __u64 oid, unsigned long size, int ret),
+
+        TP_ARGS(cid, oid, size, ret),
+
+        TP_STRUCT__entry(
+                __field(__u64, cid)
+                __field(__u64, oid)
+                __field(pid_t, pid)
+                __field(unsigned long, size)
+                __field(int, ret)
+        ),
+
+        TP_fast_assign(
+                __entry->cid = cid;
+                __entry->oid = oid;
+                __entry->pid = current->pid;
+                __entry->size = size;
+                __entry->ret = ret;
+        ),
+
+        TP_printk("cid=%llu oid=%llu pid=%d size=%lu ret=%d",
+                  __entry->cid, __entry->oid, __entry->pid, __entry->size, __entry->ret)
+);
+
+DEFINE_EVENT(mcontainer_object, mcontainer_mmap,
+        TP_PROTO(__u64 cid, __u64 oid, unsigned long size, int ret),
+        TP_ARGS(cid, oid, size, ret)
+);
+
+DEFINE_EVENT(mcontainer_object, mcontainer_free,
+        TP_PROTO(__u64 cid, __u64 oid, unsigned long size, int ret),
+        TP_ARGS(cid, oid, size, ret)
+);
+
+// Lock word operations, op is one of the LOCK_OP_* of ioctl.c. wait_ns is
+// the time from the request until the lock was taken or the wait gave up.
+DECLARE_EVENT_CLASS(mcontainer_lock,
+
+        TP_PROTO(__u64 cid, __u64 oid, int op, u64 wait_ns, int ret),
+
+        TP_ARGS(cid, oid, op, wait_ns, ret),
+
+        TP_STRUCT__entry(
+                __field(__u64, cid)
+                __field(__u64, oid)
+                __field(pid_t, pid)
+                __field(int, op)
+                __field(u64, wait_ns)
+                __field(int, ret)
+        ),
+
+        TP_fast_assign(
+                __entry->cid = cid;
+                __entry->oid = oid;
+                __entry->pid = current->pid;
+                __entry->op = op;
+                __entry->wait_ns = wait_ns;
+                __entry->ret = ret;
+        ),
+
+        TP_printk("cid=%llu oid=%llu pid=%d op=%s wait_ns=%llu ret=%d",
+                  __entry->cid, __entry->oid, __entry->pid,
+                  __print_symbolic(__entry->op, { 0, "unlock" }, { 1, "lock" }, { 2, "rdunlock" }, { 3, "rdlock" }),
+                  __entry->wait_ns, __entry->ret)
+);
+
+DEFINE_EVENT(mcontainer_lock, mcontainer_lock_request,
+        TP_PROTO(__u64 cid, __u64 oid, int op, u64 wait_ns, int ret),
+        TP_ARGS(cid, oid, op, wait_ns, ret)
+);
+
+DEFINE_EVENT(mcontainer_lock, mcontainer_lock_acquired,
+        TP_PROTO(__u64 cid, __u64 oid, int op, u64 wait_ns, int ret),
+        TP_ARGS(cid, oid, op, wait_ns, ret)
+);
+
+DEFINE_EVENT(mcontainer_lock, mcontainer_lock_release,
+        TP_PROTO(__u64 cid, __u64 oid, int op, u64 wait_ns, int ret),
+        TP_ARGS(cid, oid, op, wait_ns, ret)
+);
+
+#endif
+
+// The module's include directory is on the include path
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE memory_container_trace
+
+#include <trace/define_trace.h>
@@ -47,13 +47,23 @@ extern long memory_container_lock(struct memory_container_cmd __user *user_cmd);
 extern long memory_container_unlock(struct memory_container_cmd __user *user_cmd);
 extern long memory_container_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 extern int memory_container_mmap(struct file *filp, struct vm_area_struct *vma);
+extern int memory_container_open(struct inode *inode, struct file *filp);
+extern int memory_container_release(struct inode *inode, struct file *filp);
+extern int memory_container_flush(struct file *filp, fl_owner_t id);
+extern unsigned long memory_container_get_unmapped_area(struct file *filp, unsigned long addr,
+                                                        unsigned long len, unsigned long pgoff,
+                                                        unsigned long flags);
 extern int memory_container_init(void);
 extern void memory_container_exit(void);
 
 static const struct file_operations memory_container_fops = {
     .owner                = THIS_MODULE,
+    .open                 = memory_container_open,
+    .release              = memory_container_release,
+    .flush                = memory_container_flush,
     .unlocked_ioctl       = memory_container_ioctl,
     .mmap                 = memory_container_mmap,
+    .get_unmapped_area    = memory_container_get_unmapped_area,
 };
 
 struct miscdevice memory_container_dev = {
@@ -45,15 +45,20 @@
 #include <linux/sched.h>
 
 extern struct miscdevice memory_container_dev;
+extern void init_all_ds(void);
 extern void free_all_ds(void);
 
 int memory_container_init(void)
 {
         int ret;
 
+        init_all_ds();
+
         if ((ret = misc_register(&memory_container_dev)))
         {
                 printk(KERN_ERR "Unable to register \"memory_container\" misc device\n");
+                // The shrinker must not outlive a module that failed to load
+                free_all_ds();
                 return ret;
         }
 
@@ -31,7 +31,7 @@
 
 #include "memory_container.h"
 
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/errno.h>
@@ -44,410 +44,3365 @@
 #include <linux/mutex.h>
 #include <linux/sched.h>
 #include <linux/kthread.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/huge_mm.h>
+#include <linux/mman.h>
+#include <linux/highmem.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/wait.h>
+#include <linux/hash.h>
+#include <linux/pid.h>
+#include <linux/kref.h>
+#include <linux/atomic.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/shrinker.h>
+#include <linux/crypto.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/interval_tree.h>
+#include <linux/sched/task.h>
+#include <linux/version.h>
+
+// Needs Linux 5.4 or newer. The kernel interfaces known to have changed since
+// are wrapped here and at their single users, the README lists them
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 4, 0)
+#error "memory_container needs Linux 5.4 or newer"
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+#define kmap_local_page(page) kmap_atomic(page)
+#define kunmap_local(addr) kunmap_atomic(addr)
+#endif
+
+// PMD entries take a plain PFN once pfn_t is gone, from 6.17 on
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#define page_to_pmd_pfn(page) page_to_pfn_t(page)
+#else
+#define page_to_pmd_pfn(page) page_to_pfn(page)
+#endif
+
+// The mm's own placement of a mapping, no longer a member of mm_struct from
+// 6.10 on
+static inline unsigned long mm_unmapped_area(struct file *filp, unsigned long addr, unsigned long len,
+                                             unsigned long pgoff, unsigned long flags){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+        return mm_get_unmapped_area(current->mm, filp, addr, len, pgoff, flags);
+#else
+        return current->mm->get_unmapped_area(filp, addr, len, pgoff, flags);
+#endif
+}
 
-// Mutex for performing any updates on pid_list
-static DEFINE_MUTEX(pid_list_lock);
-
-// Mutex for performing any updates on oid_list
-static DEFINE_MUTEX(oid_list_lock);
+// VMA flags only change through helpers from 6.3 on
+static inline void set_vma_flags(struct vm_area_struct *vma, unsigned long flags){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+        vm_flags_set(vma, flags);
+#else
+        vma->vm_flags |= flags;
+#endif
+}
 
+#define CREATE_TRACE_POINTS
+#include "memory_container_trace.h"
+
+// Number of hash bits for the task, container and per-container OID tables
+#define TASK_HASH_BITS 8
+#define CONTAINER_HASH_BITS 6
+#define OID_HASH_BITS 8
+
+// Number of hash bits for the wait queues shared by all lock words
+#define LOCK_WAIT_BITS 8
+
+// Operations of update_lock_oid_in_container()
+#define LOCK_OP_UNLOCK 0
+#define LOCK_OP_LOCK 1
+#define LOCK_OP_RDUNLOCK 2
+#define LOCK_OP_RDLOCK 3
+
+// Objects listed by /proc/mcontainer/hot_objects
+#define HOT_OBJECTS 16
+
+// Header slots, holding the lock words, that fit in one header page
+#define HEADERS_PER_PAGE (PAGE_SIZE / sizeof(struct memory_container_header))
+
+// Size classes of the per-container page pool, single pages and huge pages
+#define POOL_CLASSES 2
+
+// Packed small objects start on a cache line and use at most half a page,
+// larger ones are not worth sharing a page
+#define SMALL_OBJECT_ALIGN 64
+#define SMALL_OBJECT_MAX (PAGE_SIZE / 2)
+
+// Upper bound of pages, in 4 KB units, each container keeps for reuse
+static unsigned long pool_max_pages = 1024;
+module_param(pool_max_pages, ulong, 0644);
+MODULE_PARM_DESC(pool_max_pages, "Pages each container keeps per node for reuse after objects are freed");
+
+// Containers are torn down when their last task leaves and their last
+// mapping goes away. Turned off, they live until the module is unloaded.
+static bool reclaim_empty_containers = true;
+module_param(reclaim_empty_containers, bool, 0644);
+MODULE_PARM_DESC(reclaim_empty_containers, "Free a container and all of its objects once no task or mapping uses it");
+
+// Compressor the shrinker packs pages of cold objects with
+static char *compress_algo = "lz4";
+module_param(compress_algo, charp, 0444);
+MODULE_PARM_DESC(compress_algo, "Crypto compressor for pages of cold objects under memory pressure, empty to keep objects resident");
+
+// Time a waiter for an exclusive lock spins while the holder runs on another
+// CPU, before it goes to sleep
+static unsigned int lock_spin_ns = 20000;
+module_param(lock_spin_ns, uint, 0644);
+MODULE_PARM_DESC(lock_spin_ns, "Nanoseconds a lock waiter spins while the holder is running, 0 to sleep right away");
+
+// Module wide counters reported by MCONTAINER_IOCTL_GET_STATS
+static atomic_long_t stat_containers = ATOMIC_LONG_INIT(0);
+static atomic_long_t stat_objects = ATOMIC_LONG_INIT(0);
+static atomic_long_t stat_pages = ATOMIC_LONG_INIT(0);
+static atomic_long_t stat_reclaimed_containers = ATOMIC_LONG_INIT(0);
+static atomic_long_t stat_reclaimed_pages = ATOMIC_LONG_INIT(0);
+// Pages objects hold on each NUMA node
+static atomic_long_t stat_node_pages[MAX_NUMNODES];
+static atomic_long_t stat_compressed_pages = ATOMIC_LONG_INIT(0);
+static atomic_long_t stat_compressed_bytes = ATOMIC_LONG_INIT(0);
+// Pages the shrinker can compress, see object_reclaimable()
+static atomic_long_t stat_reclaimable_pages = ATOMIC_LONG_INIT(0);
+
+// Mutex for performing any updates on task_table, readers use RCU
+static DEFINE_MUTEX(task_table_lock);
+
+// Mutex for performing any updates on container_table
+static DEFINE_MUTEX(container_table_lock);
+
+extern void init_all_ds(void);
 extern void free_all_ds(void);
 
-// Node that stores PID:CID mapping
-struct pid_node {
-        int cid;
-        int pid;
-        int valid;
-        struct pid_node *next;
+// Attributes that decide how an object is backed. A container holds the
+// defaults its new objects start with, objects may override them before
+// they are first mapped.
+struct object_attrs {
+        int hugepage;
+        int small;
+        int numa_policy;
+        int numa_node;
+        int seqlock;
+        int lock_policy;
+};
+
+// Pages of freed objects kept by a container, one pool per NUMA node. Freed
+// pages are queued dirty and zeroed by a worker, so allocation only ever takes
+// zeroed pages.
+struct page_pool {
+        int nid;
+        spinlock_t lock;
+        struct list_head clean[POOL_CLASSES];
+        struct list_head dirty[POOL_CLASSES];
+        unsigned long nr_pages;
+        struct work_struct zero_work;
+};
+
+// Compressed copy of one page of an object
+struct zpage {
+        unsigned int len;
+        u8 data[];
 };
 
-// Node that stores OID data
+// Node that stores OID data. The index holds a reference until the object is
+// freed, every mapping and every user of a lookup holds one as well.
 struct oid_node {
-        int cid;
         __u64 oid;
-        void *address;
-        struct mutex *lock;
-        struct oid_node *next;
+        struct kref ref;
+        struct container *container;
+        struct object_attrs attrs;
+        // Backing pages, allocated on first touch. A huge page fills
+        // HPAGE_PMD_NR consecutive slots with its subpages.
+        struct mutex mem_lock;
+        struct page **pages;
+        unsigned long nr_pages;
+        // Byte offset of a packed small object in its only page
+        unsigned int offset;
+        bool packed;
+        // Pages the shrinker compressed, a page lives either in pages or
+        // here. Allocated when the first page is compressed.
+        struct zpage **zpages;
+        // The shrinker zapped the object's mappings and nothing faulted since
+        bool probed;
+        // Freed, arena slots of the OID create a new object from now on
+        bool dead;
+        // Bytes charged to the container's limit when the object got its size
+        unsigned long charged;
+        // Mappings, faults and lock operations that reached the kernel, and
+        // the contended locks among them, for /proc/mcontainer/hot_objects
+        atomic_long_t nr_ops;
+        atomic_long_t nr_contended;
+        atomic64_t wait_ns;
+        // Byte ranges locked with MCONTAINER_IOCTL_LOCK_RANGE, none overlap
+        spinlock_t range_lock;
+        struct rb_root_cached ranges;
+        struct hlist_node hnode;
+        struct rcu_head rcu;
+};
+
+// One shard of a container's OID index, the lock is only taken by writers
+struct oid_bucket {
+        struct mutex lock;
+        struct hlist_head head;
 };
 
-// Actual list that stores the PID nodes
-struct pid_node *pid_list = NULL;
+// Byte range of an object a task holds, the interval is inclusive
+struct range_node {
+        struct interval_tree_node it;
+        u32 tid;
+};
 
-// Actual list that stores the OID nodes
-struct oid_node *oid_list = NULL;
+// Operation counters of a container, kept per CPU and summed up when read
+struct container_counters {
+        u64 mmaps;
+        u64 locks;
+        u64 unlocks;
+        u64 frees;
+        u64 contended;
+        u64 wait_ns;
+};
 
-void add_pid_node(int pid, int cid){
+// Container that owns the objects created by its tasks. Every member task and
+// every mapping holds a reference, lookups take one for as long as they use it.
+struct container {
+        __u64 cid;
+        struct kref ref;
+        // Pages, in 4 KB units, that objects of this container hold
+        atomic_long_t nr_pages;
+        // Objects that got a size and the bytes they take, checked against
+        // the limits set with MCONTAINER_IOCTL_SET_LIMIT, 0 for none
+        atomic_long_t charged_objects;
+        atomic_long_t charged_bytes;
+        unsigned long max_objects;
+        unsigned long max_bytes;
+        // Objects in the index
+        atomic_long_t nr_objects;
+        // Tasks in the task table that belong to the container
+        atomic_long_t nr_tasks;
+        struct container_counters __percpu *counters;
+        spinlock_t attrs_lock;
+        struct object_attrs attrs;
+        // Indexed by node id, nr_node_ids of them
+        struct page_pool *pools;
+        // Page that small objects are currently packed into, the bytes below
+        // slab_used are taken. Every object in it holds a page reference.
+        struct mutex slab_lock;
+        struct page *slab_page;
+        unsigned int slab_used;
+        // Header pages shared with user space, indexed by OID / HEADERS_PER_PAGE
+        struct xarray headers;
+        // Device mapping the container's objects are mapped through and the
+        // slot orders of its arena mappings, to zap them under memory pressure
+        struct address_space *mapping;
+        unsigned long arena_orders;
+        struct hlist_node hnode;
+        struct rcu_head rcu;
+        struct oid_bucket oid_table[1 << OID_HASH_BITS];
+};
 
-        mutex_lock(&pid_list_lock);
-        // printk("Adding PID: %d to CID: %d\n", pid, cid);
-        if(pid_list == NULL) {
-                // First PID ever
-                pid_list = (struct pid_node *)kmalloc(sizeof(struct pid_node), GFP_KERNEL);
-                pid_list->pid = pid;
-                pid_list->cid = cid;
-                pid_list->next = NULL;
-                pid_list->valid = 1;
-        } else {
-                // Later PIDs, find the tail
-                struct pid_node *prev_pid_node = NULL;
-                struct pid_node *temp_pid_node = pid_list;
-                struct pid_node *new_pid_node;
+// State of one open of the device, the tasks that joined a container
+// through it leave when the file is released
+struct mcontainer_file {
+        struct list_head tasks;
+};
+
+// Node that stores PID:container mapping
+struct pid_node {
+        int pid;
+        // Thread id the task stores in lock words it holds
+        u32 tid;
+        // Tells whether the task is still alive, the PID number may be reused
+        struct pid *task;
+        // Shared holds the task logged, see struct memory_container_holds
+        struct page *holds;
+        struct container *container;
+        struct hlist_node hnode;
+        // Entry in the task list of the file the task joined through
+        struct list_head file_node;
+        struct rcu_head rcu;
+};
+
+
+// Table that stores the PID nodes, keyed by PID
+static DEFINE_HASHTABLE(task_table, TASK_HASH_BITS);
+
+// Table that stores the containers, keyed by CID
+static DEFINE_HASHTABLE(container_table, CONTAINER_HASH_BITS);
+
+// Tasks that sleep on a lock word wait here, hashed by the word's address
+static wait_queue_head_t lock_waitqueues[1 << LOCK_WAIT_BITS];
+
+// Writer queued for a lock word of an object with the fair lock policy, it
+// lives on the stack of the sleeping task
+struct lock_waiter {
+        struct list_head node;
+        u32 *word;
+        u32 tid;
+        struct task_struct *task;
+        bool granted;
+};
+
+// Queued writers of fair lock words in arrival order, hashed by the word's
+// address like the wait queues
+struct lock_queue {
+        spinlock_t lock;
+        struct list_head waiters;
+};
+
+static struct lock_queue lock_queues[1 << LOCK_WAIT_BITS];
+
+static inline int pool_class(unsigned int order){
+        return order ? 1 : 0;
+}
+
+// Zero the pages freed into the pool off the allocation path
+static void pool_zero_work(struct work_struct *work){
+
+        struct page_pool *pool = container_of(work, struct page_pool, zero_work);
+        struct page *page;
+        unsigned int i, nr;
+        int class;
+
+        for (class = 0; class < POOL_CLASSES; class++) {
+                spin_lock(&pool->lock);
+                while (!list_empty(&pool->dirty[class])) {
+                        page = list_first_entry(&pool->dirty[class], struct page, lru);
+                        list_del(&page->lru);
+                        spin_unlock(&pool->lock);
+
+                        nr = compound_nr(page);
+                        for (i = 0; i < nr; i++) {
+                                clear_highpage(page + i);
+                                cond_resched();
+                        }
 
-                while (temp_pid_node != NULL) {
-                        prev_pid_node = temp_pid_node;
-                        temp_pid_node = temp_pid_node->next;
+                        spin_lock(&pool->lock);
+                        list_add(&page->lru, &pool->clean[class]);
                 }
+                spin_unlock(&pool->lock);
+        }
+}
+
+void pool_init(struct page_pool *pool, int nid){
 
-                // Initialize new PID node and add at tail
-                new_pid_node = (struct pid_node *)kmalloc(sizeof(struct pid_node), GFP_KERNEL);
-                new_pid_node->pid = pid;
-                new_pid_node->cid = cid;
-                new_pid_node->next = NULL;
-                new_pid_node->valid = 1;
-                prev_pid_node->next = new_pid_node;
+        int class;
+
+        pool->nid = nid;
+        spin_lock_init(&pool->lock);
+        for (class = 0; class < POOL_CLASSES; class++) {
+                INIT_LIST_HEAD(&pool->clean[class]);
+                INIT_LIST_HEAD(&pool->dirty[class]);
         }
-        mutex_unlock(&pid_list_lock);
-        return;
+        pool->nr_pages = 0;
+        INIT_WORK(&pool->zero_work, pool_zero_work);
+}
+
+// Return every pooled page to the page allocator
+void pool_destroy(struct page_pool *pool){
+
+        struct page *page, *tmp;
+        int class;
+
+        cancel_work_sync(&pool->zero_work);
+        for (class = 0; class < POOL_CLASSES; class++) {
+                list_for_each_entry_safe(page, tmp, &pool->clean[class], lru) {
+                        list_del(&page->lru);
+                        put_page(page);
+                }
+                list_for_each_entry_safe(page, tmp, &pool->dirty[class], lru) {
+                        list_del(&page->lru);
+                        put_page(page);
+                }
+        }
+        pool->nr_pages = 0;
+}
+
+// Get a zeroed page of the given order, from the pool when it has one
+struct page* pool_alloc_pages(struct page_pool *pool, gfp_t gfp, unsigned int order){
+
+        int class = pool_class(order);
+        struct page *page = NULL;
+
+        spin_lock(&pool->lock);
+        if (!list_empty(&pool->clean[class])) {
+                page = list_first_entry(&pool->clean[class], struct page, lru);
+                list_del(&page->lru);
+                pool->nr_pages -= 1UL << order;
+        }
+        spin_unlock(&pool->lock);
+
+        // The node is preferred, the allocator may still fall back to others.
+        // A recycled page stays charged to the memory cgroup it came from.
+        if (page == NULL)
+                page = alloc_pages_node(pool->nid, gfp | __GFP_ZERO, order);
+        return page;
+}
+
+// Give back the object's reference on a page. The page is recycled only when
+// no task has it mapped anymore, otherwise the last unmap frees it.
+void pool_free_pages(struct page_pool *pool, struct page *page){
+
+        unsigned long nr = compound_nr(page);
+
+        if (page_ref_count(page) == 1) {
+                spin_lock(&pool->lock);
+                if (pool->nr_pages + nr <= READ_ONCE(pool_max_pages)) {
+                        list_add(&page->lru, &pool->dirty[pool_class(compound_order(page))]);
+                        pool->nr_pages += nr;
+                        spin_unlock(&pool->lock);
+                        schedule_work(&pool->zero_work);
+                        return;
+                }
+                spin_unlock(&pool->lock);
+        }
+        put_page(page);
+}
+
+// Pool that a page goes back to, the one of the node it lives on
+static inline struct page_pool* page_pool_of(struct container *container, struct page *page){
+        return &container->pools[page_to_nid(page)];
+}
+
+// Pages taken or given back by the objects of a container
+static inline void account_pages(struct container *container, struct page *page, long nr){
+        atomic_long_add(nr, &container->nr_pages);
+        atomic_long_add(nr, &stat_pages);
+        atomic_long_add(nr, &stat_node_pages[page_to_nid(page)]);
+}
+
+// Huge pages are mapped without page references and packed pages are
+// shared with other objects, the shrinker leaves both alone. Neither changes
+// once the object has pages.
+static inline bool object_reclaimable(struct oid_node *oid_ptr){
+        return !oid_ptr->packed && !oid_ptr->attrs.hugepage;
+}
+
+void release_oid_pages(struct oid_node *oid_ptr);
+static void update_header_flags(struct container *container, __u64 oid, struct object_attrs *attrs);
+static void release_ranges(struct oid_node *oid_ptr, u32 tid);
+static void zap_oid_arena(struct oid_node *oid_ptr);
+static void release_locks_of_task(struct container *container, u32 tid);
+static void release_ranges_of_task(struct container *container, u32 tid);
+static void release_holds_of_task(struct pid_node *pid_ptr);
+int lock_word_release(u32 *word);
+void put_oid(struct oid_node *oid_ptr);
+
+// Free every object of a container that no task and no mapping uses any more
+static void destroy_container(struct container *container){
+
+        struct oid_node *oid_ptr;
+        struct hlist_node *tmp_oid;
+        struct page *page;
+        unsigned long index;
+        long nr_pages;
+        int i, nid;
+
+        nr_pages = atomic_long_read(&container->nr_pages);
+        trace_mcontainer_container_destroy(container->cid, nr_pages << PAGE_SHIFT);
+        // The current slab page goes first, its last object then returns it
+        if (container->slab_page != NULL) {
+                if (page_ref_count(container->slab_page) == 1)
+                        account_pages(container, container->slab_page, -1);
+                pool_free_pages(page_pool_of(container, container->slab_page), container->slab_page);
+        }
+        for (i = 0; i < (1 << OID_HASH_BITS); i++) {
+                hlist_for_each_entry_safe(oid_ptr, tmp_oid, &container->oid_table[i].head, hnode) {
+                        release_ranges(oid_ptr, 0);
+                        release_oid_pages(oid_ptr);
+                        kfree(oid_ptr);
+                        atomic_long_dec(&stat_objects);
+                }
+        }
+        for_each_node(nid)
+                pool_destroy(&container->pools[nid]);
+        kfree(container->pools);
+        free_percpu(container->counters);
+        xa_for_each(&container->headers, index, page)
+                __free_page(page);
+        xa_destroy(&container->headers);
+
+        atomic_long_dec(&stat_containers);
+        atomic_long_inc(&stat_reclaimed_containers);
+        atomic_long_add(nr_pages, &stat_reclaimed_pages);
+        // Lookups under RCU may still try to take a reference
+        kfree_rcu(container, rcu);
+}
+
+// Called with container_table_lock held once the last reference is gone
+static void container_release(struct kref *ref){
+
+        struct container *container = container_of(ref, struct container, ref);
+
+        hash_del(&container->hnode);
+        mutex_unlock(&container_table_lock);
+        destroy_container(container);
+}
+
+void put_container(struct container *container){
+        kref_put_mutex(&container->ref, container_release, &container_table_lock);
+}
+
+// Returns the container with a reference that the caller has to put
+struct container* get_container(__u64 cid){
+
+        struct container *container;
+        int i, nid;
+
+        mutex_lock(&container_table_lock);
+        hash_for_each_possible(container_table, container, hnode, cid) {
+                if (container->cid == cid) {
+                        // Container already exists
+                        kref_get(&container->ref);
+                        mutex_unlock(&container_table_lock);
+                        return container;
+                }
+        }
+
+        // First task of this CID, create the container
+        container = kmalloc(sizeof(struct container), GFP_KERNEL_ACCOUNT);
+        if (container != NULL) {
+                container->pools = kcalloc(nr_node_ids, sizeof(struct page_pool), GFP_KERNEL);
+                container->counters = alloc_percpu(struct container_counters);
+                if (container->pools == NULL || container->counters == NULL) {
+                        free_percpu(container->counters);
+                        kfree(container->pools);
+                        kfree(container);
+                        mutex_unlock(&container_table_lock);
+                        return NULL;
+                }
+                container->cid = cid;
+                kref_init(&container->ref);
+                // Without reclaim the table keeps a reference of its own
+                if (!reclaim_empty_containers)
+                        kref_get(&container->ref);
+                atomic_long_set(&container->nr_pages, 0);
+                atomic_long_set(&container->charged_objects, 0);
+                atomic_long_set(&container->charged_bytes, 0);
+                container->max_objects = 0;
+                container->max_bytes = 0;
+                atomic_long_set(&container->nr_objects, 0);
+                atomic_long_set(&container->nr_tasks, 0);
+                atomic_long_inc(&stat_containers);
+                spin_lock_init(&container->attrs_lock);
+                memset(&container->attrs, 0, sizeof(struct object_attrs));
+                for_each_node(nid)
+                        pool_init(&container->pools[nid], nid);
+                mutex_init(&container->slab_lock);
+                container->slab_page = NULL;
+                container->slab_used = 0;
+                xa_init(&container->headers);
+                container->mapping = NULL;
+                container->arena_orders = 0;
+                for (i = 0; i < (1 << OID_HASH_BITS); i++) {
+                        mutex_init(&container->oid_table[i].lock);
+                        INIT_HLIST_HEAD(&container->oid_table[i].head);
+                }
+                hash_add(container_table, &container->hnode, cid);
+                trace_mcontainer_container_create(cid, 0);
+        }
+        mutex_unlock(&container_table_lock);
+        return container;
+}
+
+// The PID node takes over the caller's reference on the container
+int add_pid_node(int pid, struct container *container, struct mcontainer_file *file){
+
+        struct pid_node *pid_ptr;
+        struct container *old;
+
+        mutex_lock(&task_table_lock);
+        // printk("Adding PID: %d to CID: %llu\n", pid, container->cid);
+        hash_for_each_possible(task_table, pid_ptr, hnode, pid) {
+                if (pid_ptr->pid == pid) {
+                        // PID already in a container, move it. Holds it
+                        // logged were taken in the old one.
+                        release_holds_of_task(pid_ptr);
+                        old = pid_ptr->container;
+                        atomic_long_dec(&old->nr_tasks);
+                        atomic_long_inc(&container->nr_tasks);
+                        trace_mcontainer_task_leave(old->cid, pid);
+                        trace_mcontainer_task_join(container->cid, pid);
+                        WRITE_ONCE(pid_ptr->container, container);
+                        list_move(&pid_ptr->file_node, &file->tasks);
+                        mutex_unlock(&task_table_lock);
+                        put_container(old);
+                        return 0;
+                }
+        }
+
+        // Initialize new PID node and publish it
+        pid_ptr = kmalloc(sizeof(struct pid_node), GFP_KERNEL);
+        if (pid_ptr == NULL) {
+                mutex_unlock(&task_table_lock);
+                put_container(container);
+                return -ENOMEM;
+        }
+        pid_ptr->pid = pid;
+        pid_ptr->tid = task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK;
+        pid_ptr->task = get_pid(task_pid(current));
+        pid_ptr->holds = NULL;
+        pid_ptr->container = container;
+        atomic_long_inc(&container->nr_tasks);
+        trace_mcontainer_task_join(container->cid, pid);
+        list_add(&pid_ptr->file_node, &file->tasks);
+        hash_add_rcu(task_table, &pid_ptr->hnode, pid);
+        mutex_unlock(&task_table_lock);
+        return 0;
+}
+
+// Free an unlinked PID node once lookups that may still see it are done. The
+// last task leaving tears the container down.
+static void free_pid_node(struct pid_node *pid_ptr){
+
+        if (pid_ptr->holds != NULL)
+                put_page(pid_ptr->holds);
+        put_pid(pid_ptr->task);
+        atomic_long_dec(&pid_ptr->container->nr_tasks);
+        trace_mcontainer_task_leave(pid_ptr->container->cid, pid_ptr->pid);
+        put_container(pid_ptr->container);
+        kfree_rcu(pid_ptr, rcu);
 }
 
+// The task leaves its container, locks it still holds there are released
+// like those of a task that is gone
 void remove_pid_node(int pid){
 
-        struct pid_node *curr_pid;
-        struct pid_node *prev_pid = NULL;
+        struct pid_node *pid_ptr, *found = NULL;
 
-        mutex_lock(&pid_list_lock);
+        mutex_lock(&task_table_lock);
         // printk("Deleting PID: %d\n", pid);
-        curr_pid = pid_list;
-
-        while (curr_pid != NULL) {
-                if(curr_pid->pid == pid) {
-                        // PID reference found, soft delete
-                        curr_pid->valid = 0;
+        hash_for_each_possible(task_table, pid_ptr, hnode, pid) {
+                if (pid_ptr->pid == pid) {
+                        // PID reference found, unlink it
+                        list_del(&pid_ptr->file_node);
+                        hash_del_rcu(&pid_ptr->hnode);
+                        found = pid_ptr;
                         break;
                 }
-                prev_pid = curr_pid;
-                curr_pid = curr_pid->next;
         }
-        mutex_unlock(&pid_list_lock);
+        mutex_unlock(&task_table_lock);
+
+        if (found != NULL) {
+                release_locks_of_task(found->container, found->tid);
+                release_ranges_of_task(found->container, found->tid);
+                release_holds_of_task(found);
+                free_pid_node(found);
+        }
         return;
 }
 
-int get_cid_for_pid(int pid){
-        struct pid_node *curr_pid;
-        struct pid_node *prev_pid = NULL;
-        int cid;
+// Returns the task's container with a reference that the caller has to put
+struct container* get_container_for_pid(int pid){
+        struct pid_node *pid_ptr;
+        struct container *container;
 
         // If PID is not present or was deleted
-        cid = -1;
-
-        curr_pid = pid_list;
-        while (curr_pid != NULL) {
-                if(curr_pid->pid == pid) {
-                        // PID reference found, soft delete
-                        cid = curr_pid->cid;
+        container = NULL;
+
+        rcu_read_lock();
+        hash_for_each_possible_rcu(task_table, pid_ptr, hnode, pid) {
+                if (pid_ptr->pid == pid) {
+                        // PID reference found, the container may be going
+                        // away if the task just left it
+                        container = READ_ONCE(pid_ptr->container);
+                        if (!kref_get_unless_zero(&container->ref))
+                                container = NULL;
                         break;
                 }
-                prev_pid = curr_pid;
-                curr_pid = curr_pid->next;
         }
-        // printk("PID: %d belongs to CID: %d\n", pid, cid);
-        return cid;
+        rcu_read_unlock();
+        // printk("PID: %d belongs to CID: %llu\n", pid, container ? container->cid : 0);
+        return container;
 }
 
-struct oid_node* lookup_oid_from_cid(__u64 oid, int cid){
+struct oid_node* lookup_oid_in_container(struct container *container, __u64 oid){
 
-        struct oid_node *oid_ptr = NULL;
-        struct oid_node *curr_oid;
-        struct oid_node *prev_oid = NULL;
-
-        // printk("Searching OID %llu in CID %d by PID: %d\n", oid, cid, current->pid);
-
-        curr_oid = oid_list;
-        while (curr_oid != NULL) {
-                if(curr_oid->oid == oid && curr_oid->cid == cid) {
-                        // OID reference found
-                        oid_ptr = curr_oid;
+        struct oid_bucket *bucket;
+        struct oid_node *oid_ptr;
+        struct oid_node *found = NULL;
+
+        // Lock-free lookup, writers take the bucket lock to insert and to
+        // unlink a freed object. The caller gets a reference on the node.
+        bucket = &container->oid_table[hash_64(oid, OID_HASH_BITS)];
+
+        // printk("Searching OID %llu in CID %llu by PID: %d\n", oid, container->cid, current->pid);
+        rcu_read_lock();
+        hlist_for_each_entry_rcu(oid_ptr, &bucket->head, hnode) {
+                if (oid_ptr->oid == oid) {
+                        // OID reference found, unless it is being freed
+                        if (kref_get_unless_zero(&oid_ptr->ref))
+                                found = oid_ptr;
                         break;
                 }
-                prev_oid = curr_oid;
-                curr_oid = curr_oid->next;
         }
-        return oid_ptr;
+        rcu_read_unlock();
+        return found;
 }
 
-struct oid_node* add_oid_node(__u64 oid, int cid){
+// Find or create an object, the caller has to put the returned node
+struct oid_node* get_oid_ptr_from_container(struct container *container, __u64 oid){
 
+        struct oid_bucket *bucket;
         struct oid_node *oid_ptr;
-        mutex_lock(&oid_list_lock);
 
-        // Re-check if OID is not there, if not the PID has taken the lock and
-        // also the responsibility to create the OID node
-        oid_ptr = lookup_oid_from_cid(oid, cid);
+        // Fast path, the object already exists
+        oid_ptr = lookup_oid_in_container(container, oid);
+        if (oid_ptr != NULL)
+                return oid_ptr;
 
-        if (oid_ptr == NULL) {
-                // Create new OID node, and no one else can now create it since lock is taken
-                // printk("Adding OID %llu in CID %d by PID: %d\n", oid, cid, current->pid);
-                if(oid_list == NULL) {
-                        // First OID ever
-                        oid_list = (struct oid_node *)kmalloc(sizeof(struct oid_node), GFP_KERNEL);
-                        oid_list->oid = oid;
-                        oid_list->cid = cid;
-                        oid_list->next = NULL;
-                        oid_list->address = NULL;
-                        oid_list->lock = (struct mutex *)kmalloc(sizeof(struct mutex), GFP_KERNEL);
-                        mutex_init(oid_list->lock);
-                        oid_ptr = oid_list;
-                } else {
-                        // Later OIDs, find the tail
-                        struct oid_node *prev_oid_node = NULL;
-                        struct oid_node *temp_oid_node = oid_list;
-                        struct oid_node *new_oid_node;
-
-                        while (temp_oid_node != NULL) {
-                                prev_oid_node = temp_oid_node;
-                                temp_oid_node = temp_oid_node->next;
-                        }
+        // Only the bucket that hashes this OID is locked, other OIDs and
+        // other containers proceed in parallel
+        bucket = &container->oid_table[hash_64(oid, OID_HASH_BITS)];
+        mutex_lock(&bucket->lock);
 
-                        // Initialize new OID node and add at tail
-                        new_oid_node = (struct oid_node *)kmalloc(sizeof(struct oid_node), GFP_KERNEL);
-                        new_oid_node->oid = oid;
-                        new_oid_node->cid = cid;
-                        new_oid_node->next = NULL;
-                        new_oid_node->address = NULL;
-                        new_oid_node->lock = (struct mutex *)kmalloc(sizeof(struct mutex), GFP_KERNEL);
-                        mutex_init(new_oid_node->lock);
-                        prev_oid_node->next = new_oid_node;
-                        oid_ptr = new_oid_node;
+        // Re-check if OID is not there, if not the PID has taken the lock and
+        // also the responsibility to create the OID node
+        hlist_for_each_entry(oid_ptr, &bucket->head, hnode) {
+                if (oid_ptr->oid == oid) {
+                        // Linked nodes always hold the index reference
+                        kref_get(&oid_ptr->ref);
+                        mutex_unlock(&bucket->lock);
+                        return oid_ptr;
                 }
-        } else {
-                // printk("Skip adding OID %llu in CID %d by PID: %d\n", oid, cid, current->pid);
         }
-        mutex_unlock(&oid_list_lock);
+
+        // Create new OID node and publish it once fully initialized
+        // printk("Adding OID %llu in CID %llu by PID: %d\n", oid, container->cid, current->pid);
+        oid_ptr = kmalloc(sizeof(struct oid_node), GFP_KERNEL_ACCOUNT);
+        if (oid_ptr != NULL) {
+                oid_ptr->oid = oid;
+                // One reference for the index, one for the caller
+                kref_init(&oid_ptr->ref);
+                kref_get(&oid_ptr->ref);
+                oid_ptr->container = container;
+                spin_lock(&container->attrs_lock);
+                oid_ptr->attrs = container->attrs;
+                spin_unlock(&container->attrs_lock);
+                mutex_init(&oid_ptr->mem_lock);
+                oid_ptr->pages = NULL;
+                oid_ptr->nr_pages = 0;
+                oid_ptr->offset = 0;
+                oid_ptr->packed = false;
+                oid_ptr->zpages = NULL;
+                oid_ptr->probed = false;
+                oid_ptr->dead = false;
+                oid_ptr->charged = 0;
+                // A header left by an earlier object of this OID is reset
+                update_header_flags(container, oid, &oid_ptr->attrs);
+                atomic_long_set(&oid_ptr->nr_ops, 0);
+                atomic_long_set(&oid_ptr->nr_contended, 0);
+                atomic64_set(&oid_ptr->wait_ns, 0);
+                spin_lock_init(&oid_ptr->range_lock);
+                oid_ptr->ranges = RB_ROOT_CACHED;
+                atomic_long_inc(&stat_objects);
+                atomic_long_inc(&container->nr_objects);
+                hlist_add_head_rcu(&oid_ptr->hnode, &bucket->head);
+        }
+        mutex_unlock(&bucket->lock);
         return oid_ptr;
 }
 
-struct oid_node* get_oid_ptr_from_cid(__u64 oid, int cid){
+// Find a header page of the container, allocating it on first use
+struct page* get_header_page(struct container *container, unsigned long index){
 
-        struct oid_node *oid_ptr;
+        struct page *page, *old;
 
-        // Lookup OID in CID, will get null if OID:CID doesn't exist
-        oid_ptr = lookup_oid_from_cid(oid, cid);
+        page = xa_load(&container->headers, index);
+        if (page != NULL)
+                return page;
 
-        if (oid_ptr == NULL) {
-                // If OID reference not found, create OID node and add to list
-                oid_ptr = add_oid_node(oid, cid);
+        page = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+        if (page == NULL)
+                return NULL;
+
+        // Someone else may have installed the page meanwhile
+        old = xa_cmpxchg(&container->headers, index, NULL, page, GFP_KERNEL);
+        if (old != NULL) {
+                __free_page(page);
+                return xa_is_err(old) ? NULL : old;
         }
-        return oid_ptr;
+        return page;
 }
 
-void update_lock_oid_in_cid(__u64 oid, int cid, int op){
+// Lock word of the OID, the same word user space updates through its mapping
+struct memory_container_header* get_header(struct container *container, __u64 oid){
 
-        struct oid_node *oid_ptr;
-        // Get refernce to the oid
-        oid_ptr = get_oid_ptr_from_cid(oid, cid);
-        // printk("Updating lock for OID: %llu from CID: %d by PID: %d OP: %d\n", oid, cid, current->pid, op);
-
-        if(op == 1) {
-                // Lock the oid
-                mutex_lock(oid_ptr->lock);
-                // printk("Locked OID: %llu from CID: %d by PID: %d\n", oid, cid, current->pid);
-        } else if (op == 0) {
-                // Unlock the oid
-                mutex_unlock(oid_ptr->lock);
-                // printk("Unlocked OID: %llu from CID: %d by PID: %d\n", oid, cid, current->pid);
-        }
-        return;
+        struct memory_container_header *headers;
+        struct page *page;
+
+        page = get_header_page(container, oid / HEADERS_PER_PAGE);
+        if (page == NULL)
+                return NULL;
+        headers = page_address(page);
+        return &headers[oid % HEADERS_PER_PAGE];
 }
 
-void free_all_ds() {
+// Header of the OID if its page exists already, NULL otherwise
+struct memory_container_header* peek_header(struct container *container, __u64 oid){
 
-        // printk("Start freeing everything\n");
-        // Iterate over the list and kfree everything
+        struct memory_container_header *headers;
+        struct page *page;
+
+        page = xa_load(&container->headers, oid / HEADERS_PER_PAGE);
+        if (page == NULL)
+                return NULL;
+        headers = page_address(page);
+        return &headers[oid % HEADERS_PER_PAGE];
+}
+
+static void header_change_flags(struct memory_container_header *header, u32 clear, u32 set){
+
+        u32 old, new;
 
-        // For OID list
-        struct oid_node *prev_oid_node;
-        struct oid_node *temp_oid_node = oid_list;
-        // For PID list
-        struct pid_node *prev_pid_node;
-        struct pid_node *temp_pid_node = pid_list;
+        do {
+                old = READ_ONCE(header->flags);
+                new = (old & ~clear) | set;
+        } while (old != new && cmpxchg(&header->flags, old, new) != old);
+}
 
-        while (temp_oid_node != NULL) {
-                prev_oid_node = temp_oid_node;
-                temp_oid_node = temp_oid_node->next;
-                kfree(prev_oid_node->address);
-                kfree(prev_oid_node);
+// Bring the SEQLOCK bit of a header in line with on. Writers look at the bit
+// when they take and drop the word, so it only changes while no other task
+// can be writing: the word is free and taken here for the change, or the
+// caller holds it and held is set. A word another task holds gets the
+// waiters bit instead, its unlock comes through the kernel and calls
+// sync_header_seqlock(). writing tells that the caller holds the word
+// exclusively and has not ended its write, the count is odd then while the
+// bit is set and even otherwise.
+static void header_set_seqlock(struct memory_container_header *header, bool on, bool held, bool writing){
+
+        u32 tid = task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK;
+        u32 *word = &header->lock;
+        bool taken = false;
+        u32 old;
+
+        if (!!(READ_ONCE(header->flags) & MCONTAINER_HEADER_SEQLOCK) == on)
+                return;
+        while (!held) {
+                old = READ_ONCE(*word);
+                if (!(old & MCONTAINER_LOCK_OWNER_MASK)) {
+                        if (cmpxchg(word, old, old | tid) == old)
+                                held = taken = true;
+                } else if ((old & MCONTAINER_LOCK_WAITERS) ||
+                           cmpxchg(word, old, old | MCONTAINER_LOCK_WAITERS) == old) {
+                        return;
+                }
         }
 
-        while (temp_pid_node != NULL) {
-                prev_pid_node = temp_pid_node;
-                temp_pid_node = temp_pid_node->next;
-                kfree(prev_pid_node);
+        // Readers look at the bit first, the count has to be right by then
+        if (on) {
+                if (!!(READ_ONCE(header->seq) & 1) != writing)
+                        WRITE_ONCE(header->seq, header->seq + 1);
+                smp_wmb();
+                header_change_flags(header, 0, MCONTAINER_HEADER_SEQLOCK);
+        } else {
+                header_change_flags(header, MCONTAINER_HEADER_SEQLOCK, 0);
+                smp_wmb();
+                if (READ_ONCE(header->seq) & 1)
+                        WRITE_ONCE(header->seq, header->seq + 1);
         }
-        // printk("Done freeing everything\n");
+        if (taken)
+                lock_word_release(word);
 }
 
-int memory_container_mmap(struct file *filp, struct vm_area_struct *vma)
-{
-        void *kmalloc_ptr;
-        unsigned long requested_size;
-        __u64 vtp;
-        int cid;
+// Show user space whether the object keeps a sequence count, and the lock
+// paths whether its waiters queue. A header that does not exist yet has no
+// flags set.
+static void update_header_flags(struct container *container, __u64 oid, struct object_attrs *attrs){
+
+        u32 tid = task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK;
+        struct memory_container_header *header;
+        u32 old, set = 0;
+        bool mine;
+
+        if (attrs->seqlock)
+                set |= MCONTAINER_HEADER_SEQLOCK;
+        if (attrs->lock_policy == MCONTAINER_LOCK_POLICY_FAIR)
+                set |= MCONTAINER_HEADER_FAIR;
+        header = set ? get_header(container, oid) : peek_header(container, oid);
+        if (header == NULL)
+                return;
+        // Called before the object gets its pages, it is not packed yet
+        header_change_flags(header, MCONTAINER_HEADER_FAIR | MCONTAINER_HEADER_PACKED, set & MCONTAINER_HEADER_FAIR);
+        // The caller may have locked the object before it created it, and
+        // writes it once back in user space
+        old = READ_ONCE(header->lock);
+        mine = !(old & MCONTAINER_LOCK_SHARED) && (old & MCONTAINER_LOCK_OWNER_MASK) == tid;
+        header_set_seqlock(header, attrs->seqlock, mine, mine);
+}
+
+// Apply a SEQLOCK change put off while another task held the word. Called
+// by a holder of the word, after it ended its write.
+static void sync_header_seqlock(struct container *container, __u64 oid, u32 *word){
+
         struct oid_node *oid_ptr;
+        bool on;
+
+        oid_ptr = lookup_oid_in_container(container, oid);
+        if (oid_ptr == NULL)
+                return;
+        on = READ_ONCE(oid_ptr->attrs.seqlock);
+        put_oid(oid_ptr);
+        header_set_seqlock(container_of(word, struct memory_container_header, lock), on, true, false);
+}
+
+// Tell user space where a packed object sits in its page, so that mappings
+// of the page and arena slots find it without asking
+static void mark_header_packed(struct container *container, __u64 oid, unsigned int offset){
+
+        struct memory_container_header *header;
+        u32 old;
+
+        header = get_header(container, oid);
+        if (header == NULL)
+                return;
+        WRITE_ONCE(header->offset, offset);
+        smp_wmb();
+        do {
+                old = READ_ONCE(header->flags);
+        } while (cmpxchg(&header->flags, old, old | MCONTAINER_HEADER_PACKED) != old);
+}
 
-        // Get the CID for PID
-        cid = get_cid_for_pid(current->pid);
+// A writer that took the lock word of a seqlock object makes the sequence
+// count odd before it touches the object, and even again once it is done
+static void seq_write_begin(u32 *word){
 
-        // Get OID reference for given CID
-        oid_ptr = get_oid_ptr_from_cid((__u64)vma->vm_pgoff, cid);
+        struct memory_container_header *header = container_of(word, struct memory_container_header, lock);
 
-        // Calculate requested page size
-        requested_size = vma->vm_end - vma->vm_start;
+        if (!(READ_ONCE(header->flags) & MCONTAINER_HEADER_SEQLOCK))
+                return;
+        WRITE_ONCE(header->seq, header->seq + 1);
+        smp_wmb();
+}
 
-        if (oid_ptr->address == NULL) {
+static void seq_write_end(u32 *word){
 
-                kmalloc_ptr = NULL;
-                kmalloc_ptr = kzalloc(requested_size, GFP_KERNEL);
-                oid_ptr->address = kmalloc_ptr;
-                vtp = virt_to_phys(kmalloc_ptr);
+        struct memory_container_header *header = container_of(word, struct memory_container_header, lock);
 
-                // printk("Assigning new mem for OID: %ld from PID: %d\n", vma->vm_pgoff, current->pid);
-                // printk("OID addr %pS\n", oid_ptr->address);
-                // printk("VTP: %llu\n", vtp);
-                // printk("PAGE_SIZE: %lu\n", PAGE_SIZE);
-                // printk("Requested size: %lu\n", requested_size);
-                // printk("Start: %lu\n", vma->vm_start);
-                // printk("End: %lu\n", vma->vm_end);
-                // printk("PAGE_SHIFT %d\n", PAGE_SHIFT);
-                // printk("PAGE_SHIFT value %llu\n",vtp >> PAGE_SHIFT);
+        if (!(READ_ONCE(header->flags) & MCONTAINER_HEADER_SEQLOCK))
+                return;
+        smp_wmb();
+        WRITE_ONCE(header->seq, header->seq + 1);
+}
+
+u32* get_lock_word(struct container *container, __u64 oid){
+
+        struct memory_container_header *header;
+
+        header = get_header(container, oid);
+        if (header == NULL)
+                return NULL;
+        return &header->lock;
+}
+
+static inline wait_queue_head_t* lock_waitqueue(u32 *word){
+        return &lock_waitqueues[hash_ptr(word, LOCK_WAIT_BITS)];
+}
+
+static inline struct lock_queue* lock_queue(u32 *word){
+        return &lock_queues[hash_ptr(word, LOCK_WAIT_BITS)];
+}
+
+static inline bool lock_word_fair(u32 *word){
+        return READ_ONCE(container_of(word, struct memory_container_header, lock)->flags) & MCONTAINER_HEADER_FAIR;
+}
+
+// Spin while the exclusive holder of the word runs on another CPU, it is
+// likely to unlock before sleeping and waking up would pay off. Stops once
+// the holder changes, sleeps or lock_spin_ns passed.
+static void lock_word_spin(u32 *word){
+
+#ifdef CONFIG_SMP
+        struct task_struct *owner;
+        u32 old, mask = MCONTAINER_LOCK_SHARED | MCONTAINER_LOCK_OWNER_MASK;
+        u64 deadline;
+
+        old = READ_ONCE(*word);
+        if (lock_spin_ns == 0 || !(old & MCONTAINER_LOCK_OWNER_MASK) || (old & MCONTAINER_LOCK_SHARED))
+                return;
+        deadline = ktime_get_ns() + lock_spin_ns;
+        // The owner cannot go away while we look at it
+        rcu_read_lock();
+        owner = pid_task(find_vpid(old & MCONTAINER_LOCK_OWNER_MASK), PIDTYPE_PID);
+        while (owner != NULL && READ_ONCE(owner->on_cpu) && !vcpu_is_preempted(task_cpu(owner)) &&
+               (READ_ONCE(*word) & mask) == (old & mask) && !need_resched() && ktime_get_ns() < deadline)
+                cpu_relax();
+        rcu_read_unlock();
+#endif
+}
+
+// First writer queued for the word after waiter, or from the head of the
+// queue for NULL. Called with the queue lock held.
+static struct lock_waiter* next_waiter(struct lock_queue *queue, u32 *word, struct lock_waiter *waiter){
+
+        waiter = waiter ? list_next_entry(waiter, node) : list_first_entry(&queue->waiters, struct lock_waiter, node);
+        list_for_each_entry_from(waiter, &queue->waiters, node) {
+                if (waiter->word == word)
+                        return waiter;
+        }
+        return NULL;
+}
+
+// Pass a fair lock word its holder gives up to the first queued writer, or
+// free it when none waits. Called with the queue lock held, fails when the
+// word does not hold old any more.
+static bool lock_word_handoff(struct lock_queue *queue, u32 *word, u32 old){
 
-                if (remap_pfn_range(vma, vma->vm_start, vtp >> PAGE_SHIFT, vma->vm_end - vma->vm_start, vma->vm_page_prot) < 0)
-                {
-                        printk("remap_pfn_range failed\n");
-                        return -EIO;
+        struct lock_waiter *waiter = next_waiter(queue, word, NULL);
+        struct task_struct *task;
+        u32 new = 0;
+
+        if (waiter != NULL) {
+                // The new owner unlocks through the kernel to pass it on
+                new = waiter->tid | MCONTAINER_LOCK_WAITERS;
+                if (next_waiter(queue, word, waiter) != NULL)
+                        new |= MCONTAINER_LOCK_WRITER_WAITING;
+        }
+        if (cmpxchg(word, old, new) != old)
+                return false;
+
+        if (waiter == NULL) {
+                if (old & MCONTAINER_LOCK_WAITERS)
+                        wake_up_all(lock_waitqueue(word));
+                return true;
+        }
+        // The waiter returns as soon as it sees granted, with it its stack
+        task = waiter->task;
+        get_task_struct(task);
+        list_del(&waiter->node);
+        smp_store_release(&waiter->granted, true);
+        wake_up_process(task);
+        put_task_struct(task);
+        return true;
+}
+
+// Takes the queue lock and returns the queue when an unlock has to hand the
+// word over: the word is fair, or writers queued while it was fair still
+// wait after the object was freed and created again under the throughput
+// policy. old is the word as the caller read it, queued writers keep
+// MCONTAINER_LOCK_WRITER_WAITING set and set it under the queue lock.
+static struct lock_queue* lock_word_handoff_queue(u32 *word, u32 old){
+
+        struct lock_queue *queue;
+
+        if (!lock_word_fair(word) && !(old & MCONTAINER_LOCK_WRITER_WAITING))
+                return NULL;
+        queue = lock_queue(word);
+        spin_lock(&queue->lock);
+        if (lock_word_fair(word) || next_waiter(queue, word, NULL) != NULL)
+                return queue;
+        spin_unlock(&queue->lock);
+        return NULL;
+}
+
+// Slow path of an exclusive lock on a fair word. Writers queue in arrival
+// order and an unlock hands the word straight to the first one, it is never
+// free in between for a later writer to take.
+static int lock_word_acquire_fair(u32 *word, long timeout){
+
+        struct lock_queue *queue = lock_queue(word);
+        struct lock_waiter waiter;
+        u32 old;
+        int ret = 0;
+
+        waiter.word = word;
+        waiter.tid = task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK;
+        waiter.task = current;
+        waiter.granted = false;
+
+        spin_lock(&queue->lock);
+        for (;;) {
+                old = READ_ONCE(*word);
+                // Nobody is queued for a free word, unlocks hand it over
+                if (!(old & MCONTAINER_LOCK_OWNER_MASK)) {
+                        if (cmpxchg(word, old, waiter.tid | MCONTAINER_LOCK_WAITERS) == old)
+                                goto out;
+                        continue;
                 }
+                if (timeout == 0) {
+                        ret = -EBUSY;
+                        goto out;
+                }
+                // The holder unlocks through the kernel from now on
+                if (cmpxchg(word, old, old | MCONTAINER_LOCK_WAITERS | MCONTAINER_LOCK_WRITER_WAITING) == old)
+                        break;
+        }
+        list_add_tail(&waiter.node, &queue->waiters);
+        spin_unlock(&queue->lock);
 
+        for (;;) {
+                set_current_state(TASK_INTERRUPTIBLE);
+                if (smp_load_acquire(&waiter.granted))
+                        break;
+                if (signal_pending(current)) {
+                        ret = -ERESTARTSYS;
+                        break;
+                }
+                if (timeout == 0) {
+                        ret = -ETIMEDOUT;
+                        break;
+                }
+                timeout = schedule_timeout(timeout);
+        }
+        __set_current_state(TASK_RUNNING);
+        if (ret == 0)
+                return 0;
+
+        // Leave the queue, unless the word was handed over meanwhile
+        spin_lock(&queue->lock);
+        if (waiter.granted) {
+                ret = 0;
         } else {
-                vtp = virt_to_phys(oid_ptr->address);
+                list_del(&waiter.node);
+                // Without queued writers readers may come in again
+                if (next_waiter(queue, word, NULL) == NULL) {
+                        do {
+                                old = READ_ONCE(*word);
+                        } while ((old & MCONTAINER_LOCK_WRITER_WAITING) &&
+                                 cmpxchg(word, old, old & ~MCONTAINER_LOCK_WRITER_WAITING) != old);
+                        wake_up_all(lock_waitqueue(word));
+                }
+        }
+out:
+        spin_unlock(&queue->lock);
+        return ret;
+}
 
-                // printk("Accessing mem for OID: %ld\n from PID: %d", vma->vm_pgoff, current->pid);
-                // printk("OID addr %pS\n", oid_ptr->address);
-                // printk("VTP: %llu\n", vtp);
-                // printk("PAGE_SIZE: %lu\n", PAGE_SIZE);
-                // printk("Requested size: %lu\n", requested_size);
-                // printk("Start: %lu\n", vma->vm_start);
-                // printk("End: %lu\n", vma->vm_end);
-                // printk("PAGE_SHIFT %d\n", PAGE_SHIFT);
-                // printk("PAGE_SHIFT value %llu\n",vtp >> PAGE_SHIFT);
+// Slow path of an exclusive lock, entered when the user space
+// compare-and-swap failed. Waits at most timeout jiffies, a timeout of 0
+// only tries once and MAX_SCHEDULE_TIMEOUT waits until the lock is free.
+int lock_word_acquire(u32 *word, long timeout){
+
+        u32 tid = task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK;
+        u32 old, waiting;
+        long ret;
+
+        if (timeout != 0)
+                lock_word_spin(word);
+        if (lock_word_fair(word))
+                return lock_word_acquire_fair(word, timeout);
+
+        for (;;) {
+                old = READ_ONCE(*word);
+                if (!(old & MCONTAINER_LOCK_OWNER_MASK)) {
+                        // Keep the waiters bit, others may still be asleep
+                        // and our unlock has to wake them
+                        if (cmpxchg(word, old, tid | MCONTAINER_LOCK_WAITERS) == old)
+                                return 0;
+                        continue;
+                }
 
-                if (remap_pfn_range(vma, vma->vm_start, vtp >> PAGE_SHIFT, vma->vm_end - vma->vm_start, vma->vm_page_prot) < 0)
-                {
-                        printk("remap_pfn_range failed\n");
-                        return -EIO;
+                if (timeout == 0)
+                        return -EBUSY;
+
+                // Tell the holder to come through the kernel on unlock, and
+                // hold back new readers so writers are not starved
+                waiting = old | MCONTAINER_LOCK_WAITERS | MCONTAINER_LOCK_WRITER_WAITING;
+                if (old != waiting && cmpxchg(word, old, waiting) != old)
+                        continue;
+
+                ret = wait_event_interruptible_timeout(*lock_waitqueue(word), READ_ONCE(*word) != waiting, timeout);
+                if (ret <= 0) {
+                        // Let readers in again, writers still waiting set
+                        // the bit again once they are woken up
+                        do {
+                                old = READ_ONCE(*word);
+                        } while ((old & MCONTAINER_LOCK_WRITER_WAITING) &&
+                                 cmpxchg(word, old, old & ~MCONTAINER_LOCK_WRITER_WAITING) != old);
+                        wake_up_all(lock_waitqueue(word));
+                        return ret ? ret : -ETIMEDOUT;
                 }
+                if (timeout != MAX_SCHEDULE_TIMEOUT)
+                        timeout = ret;
         }
-        return 0;
 }
 
-int memory_container_lock(struct memory_container_cmd __user *user_cmd)
-{
-        int cid;
+// Slow path of a shared lock, readers only wait for a writer that holds the
+// lock or is waiting for it. The timeout works as for lock_word_acquire().
+int lock_word_acquire_shared(u32 *word, long timeout){
+
+        u32 old;
+        long ret;
+
+        for (;;) {
+                old = READ_ONCE(*word);
+                if (!(old & MCONTAINER_LOCK_WRITER_WAITING) &&
+                    (!(old & MCONTAINER_LOCK_OWNER_MASK) || (old & MCONTAINER_LOCK_SHARED))) {
+                        if ((old & MCONTAINER_LOCK_OWNER_MASK) == MCONTAINER_LOCK_OWNER_MASK)
+                                return -EAGAIN;
+                        if (cmpxchg(word, old, (old | MCONTAINER_LOCK_SHARED) + 1) == old)
+                                return 0;
+                        continue;
+                }
 
-        // Get the current CID
-        struct memory_container_cmd *user_cmd_kernal;
+                if (timeout == 0)
+                        return -EBUSY;
 
-        user_cmd_kernal = kmalloc(sizeof(struct memory_container_cmd), GFP_KERNEL);
-        copy_from_user(user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd));
+                if (!(old & MCONTAINER_LOCK_WAITERS) &&
+                    cmpxchg(word, old, old | MCONTAINER_LOCK_WAITERS) != old)
+                        continue;
 
-        // Get CID for PID
-        cid = get_cid_for_pid(current->pid);
+                ret = wait_event_interruptible_timeout(*lock_waitqueue(word),
+                                                       READ_ONCE(*word) != (old | MCONTAINER_LOCK_WAITERS), timeout);
+                if (ret <= 0)
+                        return ret ? ret : -ETIMEDOUT;
+                if (timeout != MAX_SCHEDULE_TIMEOUT)
+                        timeout = ret;
+        }
+}
 
-        update_lock_oid_in_cid(user_cmd_kernal->oid, cid, 1); // 1 Means unlock
-        return 0;
+int lock_word_release(u32 *word){
+
+        u32 tid = task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK;
+        struct lock_queue *queue;
+        u32 old;
+        int ret = 0;
+
+        for (;;) {
+                old = READ_ONCE(*word);
+                queue = lock_word_handoff_queue(word, old);
+                if (queue != NULL)
+                        break;
+                if ((old & MCONTAINER_LOCK_SHARED) || (old & MCONTAINER_LOCK_OWNER_MASK) != tid)
+                        return -EPERM;
+                // A waiting writer keeps readers out across the hand over
+                if (cmpxchg(word, old, old & MCONTAINER_LOCK_WRITER_WAITING) == old) {
+                        if (old & MCONTAINER_LOCK_WAITERS)
+                                wake_up_all(lock_waitqueue(word));
+                        return 0;
+                }
+        }
+
+        do {
+                old = READ_ONCE(*word);
+                if ((old & MCONTAINER_LOCK_SHARED) || (old & MCONTAINER_LOCK_OWNER_MASK) != tid) {
+                        ret = -EPERM;
+                        break;
+                }
+        } while (!lock_word_handoff(queue, word, old));
+        spin_unlock(&queue->lock);
+        return ret;
 }
 
-int memory_container_unlock(struct memory_container_cmd __user *user_cmd)
-{
-        int cid;
+int lock_word_release_shared(u32 *word){
 
-        // Get the current CID
-        struct memory_container_cmd *user_cmd_kernal;
+        struct lock_queue *queue;
+        u32 old, new;
+        int ret = 0;
 
-        user_cmd_kernal = kmalloc(sizeof(struct memory_container_cmd), GFP_KERNEL);
-        copy_from_user(user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd));
+        for (;;) {
+                old = READ_ONCE(*word);
+                queue = lock_word_handoff_queue(word, old);
+                if (queue != NULL)
+                        break;
+                if (!(old & MCONTAINER_LOCK_SHARED) || !(old & MCONTAINER_LOCK_OWNER_MASK))
+                        return -EPERM;
+                new = old - 1;
+                // The last reader clears the shared mode and wakes the waiters
+                if (!(new & MCONTAINER_LOCK_OWNER_MASK))
+                        new &= ~(MCONTAINER_LOCK_SHARED | MCONTAINER_LOCK_WAITERS);
+                if (cmpxchg(word, old, new) == old) {
+                        if ((old & MCONTAINER_LOCK_WAITERS) && !(new & MCONTAINER_LOCK_OWNER_MASK))
+                                wake_up_all(lock_waitqueue(word));
+                        return 0;
+                }
+        }
 
-        // Get CID for PID
-        cid = get_cid_for_pid(current->pid);
+        for (;;) {
+                old = READ_ONCE(*word);
+                if (!(old & MCONTAINER_LOCK_SHARED) || !(old & MCONTAINER_LOCK_OWNER_MASK)) {
+                        ret = -EPERM;
+                        break;
+                }
+                // The last reader hands over to the first queued writer
+                if ((old & MCONTAINER_LOCK_OWNER_MASK) == 1) {
+                        if (lock_word_handoff(queue, word, old))
+                                break;
+                } else if (cmpxchg(word, old, old - 1) == old) {
+                        break;
+                }
+        }
+        spin_unlock(&queue->lock);
+        return ret;
+}
 
-        update_lock_oid_in_cid(user_cmd_kernal->oid, cid, 0); // 0 Means unlock
-        return 0;
+// Release every lock word a task left held exclusively, waking its waiters.
+// Shared holds only count readers and cannot be traced back to a task.
+static void release_locks_of_task(struct container *container, u32 tid){
+
+        struct memory_container_header *headers;
+        struct lock_queue *queue;
+        struct page *page;
+        unsigned long index, i;
+        u32 *word, old;
+        bool done;
+
+        xa_for_each(&container->headers, index, page) {
+                headers = page_address(page);
+                for (i = 0; i < HEADERS_PER_PAGE; i++) {
+                        word = &headers[i].lock;
+                        for (;;) {
+                                old = READ_ONCE(*word);
+                                if ((old & MCONTAINER_LOCK_SHARED) || (old & MCONTAINER_LOCK_OWNER_MASK) != tid)
+                                        break;
+                                // The task may have died inside its write
+                                if (READ_ONCE(headers[i].seq) & 1)
+                                        seq_write_end(word);
+                                if (old & MCONTAINER_LOCK_WAITERS)
+                                        sync_header_seqlock(container, index * HEADERS_PER_PAGE + i, word);
+                                queue = lock_word_handoff_queue(word, old);
+                                if (queue != NULL) {
+                                        done = lock_word_handoff(queue, word, old);
+                                        spin_unlock(&queue->lock);
+                                        if (done)
+                                                break;
+                                        continue;
+                                }
+                                if (cmpxchg(word, old, old & MCONTAINER_LOCK_WRITER_WAITING) == old) {
+                                        if (old & MCONTAINER_LOCK_WAITERS)
+                                                wake_up_all(lock_waitqueue(word));
+                                        break;
+                                }
+                        }
+                }
+                cond_resched();
+        }
 }
 
-int memory_container_delete(struct memory_container_cmd __user *user_cmd)
-{
-        // Delete the PID from list
-        remove_pid_node(current->pid);
-        return 0;
+// Drop the shared holds a task logged and did not release. Only called for
+// a task that is gone or that is inside the kernel itself, nobody else
+// writes its log then.
+static void release_holds_of_task(struct pid_node *pid_ptr){
+
+        struct memory_container_holds *holds;
+        u32 *word;
+        __u64 oid;
+        int i;
+
+        if (pid_ptr->holds == NULL)
+                return;
+        holds = page_address(pid_ptr->holds);
+        for (i = 0; i < MCONTAINER_HOLDS_MAX; i++) {
+                oid = READ_ONCE(holds->oid[i]);
+                if (oid == 0)
+                        continue;
+                WRITE_ONCE(holds->oid[i], 0);
+                word = get_lock_word(pid_ptr->container, oid - 1);
+                if (word == NULL)
+                        continue;
+                if (READ_ONCE(*word) & MCONTAINER_LOCK_WAITERS)
+                        sync_header_seqlock(pid_ptr->container, oid - 1, word);
+                lock_word_release_shared(word);
+        }
 }
 
-int memory_container_create(struct memory_container_cmd __user *user_cmd)
-{
-        // Get the current CID
-        struct memory_container_cmd *user_cmd_kernal;
+// Ranges of an object are locked exclusively against each other. Every range
+// also holds the object's lock word shared, so that locking the whole object
+// waits for all ranges and the other way round.
+
+// Take the range unless it overlaps a held one, returns 1 once it is taken.
+// Range holders write without moving the sequence count, so objects with
+// the seqlock attribute have no ranges. range_lock orders the check against
+// setting the attribute.
+static int range_insert(struct oid_node *oid_ptr, struct range_node *range){
+
+        int taken;
+
+        spin_lock(&oid_ptr->range_lock);
+        if (oid_ptr->attrs.seqlock)
+                taken = -EINVAL;
+        else
+                taken = interval_tree_iter_first(&oid_ptr->ranges, range->it.start, range->it.last) == NULL;
+        if (taken > 0)
+                interval_tree_insert(&range->it, &oid_ptr->ranges);
+        spin_unlock(&oid_ptr->range_lock);
+        return taken;
+}
+
+int lock_range_in_container(struct container *container, __u64 oid, __u64 offset, __u64 length){
 
-        user_cmd_kernal = kmalloc(sizeof(struct memory_container_cmd), GFP_KERNEL);
-        copy_from_user(user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd));
+        struct oid_node *oid_ptr;
+        struct range_node *range;
+        u32 *word;
+        int ret, taken = 0;
+
+        if (length == 0 || offset + length - 1 < offset)
+                return -EINVAL;
+        word = get_lock_word(container, oid);
+        if (word == NULL)
+                return -ENOMEM;
+        oid_ptr = get_oid_ptr_from_container(container, oid);
+        if (oid_ptr == NULL)
+                return -ENOMEM;
+        if (READ_ONCE(oid_ptr->attrs.seqlock)) {
+                put_oid(oid_ptr);
+                return -EINVAL;
+        }
+        range = kmalloc(sizeof(struct range_node), GFP_KERNEL_ACCOUNT);
+        if (range == NULL) {
+                put_oid(oid_ptr);
+                return -ENOMEM;
+        }
+        range->it.start = offset;
+        range->it.last = offset + length - 1;
+        range->tid = task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK;
+
+        ret = lock_word_acquire_shared(word, MAX_SCHEDULE_TIMEOUT);
+        if (ret == 0) {
+                // Released ranges wake the waiters of the lock word
+                ret = wait_event_interruptible(*lock_waitqueue(word), (taken = range_insert(oid_ptr, range)) != 0);
+                if (ret == 0 && taken < 0)
+                        ret = taken;
+                if (ret)
+                        lock_word_release_shared(word);
+        }
+        if (ret)
+                kfree(range);
+        else
+                this_cpu_inc(container->counters->locks);
+        put_oid(oid_ptr);
+        return ret;
+}
 
-        // Add the PID:CID mapping node
-        add_pid_node(current->pid, user_cmd_kernal->cid);
+int unlock_range_in_container(struct container *container, __u64 oid, __u64 offset, __u64 length){
 
+        u32 tid = task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK;
+        struct interval_tree_node *it;
+        struct range_node *range = NULL;
+        struct oid_node *oid_ptr;
+        u32 *word;
+
+        if (length == 0 || offset + length - 1 < offset)
+                return -EINVAL;
+        oid_ptr = lookup_oid_in_container(container, oid);
+        if (oid_ptr == NULL)
+                return -EPERM;
+
+        spin_lock(&oid_ptr->range_lock);
+        for (it = interval_tree_iter_first(&oid_ptr->ranges, offset, offset + length - 1); it != NULL;
+             it = interval_tree_iter_next(it, offset, offset + length - 1)) {
+                if (it->start == offset && it->last == offset + length - 1 &&
+                    container_of(it, struct range_node, it)->tid == tid) {
+                        interval_tree_remove(it, &oid_ptr->ranges);
+                        range = container_of(it, struct range_node, it);
+                        break;
+                }
+        }
+        spin_unlock(&oid_ptr->range_lock);
+        put_oid(oid_ptr);
+
+        // Only the exact range a task locked can be unlocked by it
+        if (range == NULL)
+                return -EPERM;
+        kfree(range);
+        this_cpu_inc(container->counters->unlocks);
+        word = get_lock_word(container, oid);
+        lock_word_release_shared(word);
+        wake_up_all(lock_waitqueue(word));
         return 0;
 }
 
-int memory_container_free(struct memory_container_cmd __user *user_cmd)
-{
-        int cid;
-        struct memory_container_cmd *user_cmd_kernal;
+// Drop the ranges of an object a task holds, or all of them for tid 0,
+// together with their holds on the lock word
+static void release_ranges(struct oid_node *oid_ptr, u32 tid){
+
+        struct memory_container_header *header;
+        struct interval_tree_node *it, *next;
+        struct range_node *range;
+        unsigned long nr = 0;
+
+        spin_lock(&oid_ptr->range_lock);
+        for (it = interval_tree_iter_first(&oid_ptr->ranges, 0, ULONG_MAX); it != NULL; it = next) {
+                next = interval_tree_iter_next(it, 0, ULONG_MAX);
+                range = container_of(it, struct range_node, it);
+                if (tid != 0 && range->tid != tid)
+                        continue;
+                interval_tree_remove(it, &oid_ptr->ranges);
+                kfree(range);
+                nr++;
+        }
+        spin_unlock(&oid_ptr->range_lock);
+
+        // Taking a range created the header
+        header = nr ? peek_header(oid_ptr->container, oid_ptr->oid) : NULL;
+        if (header == NULL)
+                return;
+        while (nr--)
+                lock_word_release_shared(&header->lock);
+        wake_up_all(lock_waitqueue(&header->lock));
+}
+
+static void release_ranges_of_task(struct container *container, u32 tid){
+
         struct oid_node *oid_ptr;
+        int i;
 
-        // Get the CID for PID
-        cid = get_cid_for_pid(current->pid);
+        rcu_read_lock();
+        for (i = 0; i < (1 << OID_HASH_BITS); i++) {
+                hlist_for_each_entry_rcu(oid_ptr, &container->oid_table[i].head, hnode)
+                        release_ranges(oid_ptr, tid);
+        }
+        rcu_read_unlock();
+}
 
-        // Get OID from user_cmd
-        user_cmd_kernal = kmalloc(sizeof(struct memory_container_cmd), GFP_KERNEL);
-        copy_from_user(user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd));
+// Count a lock operation against its object, and the time it waited when
+// the lock was taken by someone else. Objects never mapped are not counted.
+static void count_lock_op(struct container *container, __u64 oid, bool contended, u64 wait_ns){
 
-        oid_ptr = get_oid_ptr_from_cid(user_cmd_kernal->oid, cid);
+        struct oid_node *oid_ptr;
 
-        // Free the memory held by the object
-        // printk("Trying to free Memory for OID: %llu in CID: %d by PID %d\n", user_cmd_kernal->oid, cid, current->pid);
-        // printk("VOID pointer %pS\n", oid_ptr->address);
-        kfree(oid_ptr->address);
-        oid_ptr->address = NULL;
-        // printk("Memory freed for OID: %llu in CID: %d by PID %d\n", user_cmd_kernal->oid, cid, current->pid);
+        if (contended) {
+                this_cpu_inc(container->counters->contended);
+                this_cpu_add(container->counters->wait_ns, wait_ns);
+        }
 
-        return 0;
+        rcu_read_lock();
+        hlist_for_each_entry_rcu(oid_ptr, &container->oid_table[hash_64(oid, OID_HASH_BITS)].head, hnode) {
+                if (oid_ptr->oid == oid) {
+                        atomic_long_inc(&oid_ptr->nr_ops);
+                        if (contended) {
+                                atomic_long_inc(&oid_ptr->nr_contended);
+                                atomic64_add(wait_ns, &oid_ptr->wait_ns);
+                        }
+                        break;
+                }
+        }
+        rcu_read_unlock();
+}
+
+// Lock operations wait at most timeout jiffies, see lock_word_acquire()
+int update_lock_oid_in_container(struct container *container, __u64 oid, int op, long timeout){
+
+        u32 *word, old;
+        bool contended, timed;
+        u64 start, wait_ns;
+        int ret;
+
+        // Get reference to the lock word of the oid
+        word = get_lock_word(container, oid);
+        if (word == NULL)
+                return -ENOMEM;
+        // printk("Updating lock for OID: %llu from CID: %llu by PID: %d OP: %d\n", oid, container->cid, current->pid, op);
+
+        switch (op) {
+        case LOCK_OP_LOCK:
+        case LOCK_OP_RDLOCK:
+                // Contended if the lock cannot be taken right away
+                old = READ_ONCE(*word);
+                if (op == LOCK_OP_LOCK)
+                        contended = old & MCONTAINER_LOCK_OWNER_MASK;
+                else
+                        contended = (old & MCONTAINER_LOCK_WRITER_WAITING) ||
+                                    ((old & MCONTAINER_LOCK_OWNER_MASK) && !(old & MCONTAINER_LOCK_SHARED));
+                // The clock is only read when someone wants the wait
+                timed = contended || trace_mcontainer_lock_acquired_enabled();
+                start = timed ? ktime_get_ns() : 0;
+                trace_mcontainer_lock_request(container->cid, oid, op, 0, 0);
+                if (op == LOCK_OP_LOCK) {
+                        ret = lock_word_acquire(word, timeout);
+                        if (ret == 0)
+                                seq_write_begin(word);
+                } else {
+                        ret = lock_word_acquire_shared(word, timeout);
+                }
+                wait_ns = timed ? ktime_get_ns() - start : 0;
+                trace_mcontainer_lock_acquired(container->cid, oid, op, wait_ns, ret);
+                this_cpu_inc(container->counters->locks);
+                count_lock_op(container, oid, contended, contended ? wait_ns : 0);
+                return ret;
+        case LOCK_OP_UNLOCK:
+                this_cpu_inc(container->counters->unlocks);
+                // Only the owner ends the write, the release fails otherwise
+                old = READ_ONCE(*word);
+                if (!(old & MCONTAINER_LOCK_SHARED) &&
+                    (old & MCONTAINER_LOCK_OWNER_MASK) == (task_pid_vnr(current) & MCONTAINER_LOCK_OWNER_MASK)) {
+                        seq_write_end(word);
+                        if (old & MCONTAINER_LOCK_WAITERS)
+                                sync_header_seqlock(container, oid, word);
+                }
+                ret = lock_word_release(word);
+                trace_mcontainer_lock_release(container->cid, oid, op, 0, ret);
+                return ret;
+        case LOCK_OP_RDUNLOCK:
+                this_cpu_inc(container->counters->unlocks);
+                old = READ_ONCE(*word);
+                if ((old & MCONTAINER_LOCK_SHARED) && (old & MCONTAINER_LOCK_OWNER_MASK) && (old & MCONTAINER_LOCK_WAITERS))
+                        sync_header_seqlock(container, oid, word);
+                ret = lock_word_release_shared(word);
+                trace_mcontainer_lock_release(container->cid, oid, op, 0, ret);
+                return ret;
+        default:
+                return -EINVAL;
+        }
 }
 
+// Node that page index of an object should come from. Interleaved objects
+// spread their pages, in units of the page size they are faulted with, over
+// the nodes that have memory.
+static int oid_page_node(struct oid_node *oid_ptr, unsigned long index){
+
+        unsigned int nth;
+        int nid;
+
+        switch (oid_ptr->attrs.numa_policy) {
+        case MCONTAINER_NUMA_PREFERRED:
+                return oid_ptr->attrs.numa_node;
+        case MCONTAINER_NUMA_INTERLEAVE:
+                if (oid_ptr->attrs.hugepage)
+                        index /= HPAGE_PMD_NR;
+                nth = (oid_ptr->oid + index) % num_node_state(N_MEMORY);
+                for_each_node_state(nid, N_MEMORY) {
+                        if (nth-- == 0)
+                                return nid;
+                }
+                fallthrough;
+        default:
+                // First touch, the node of the faulting CPU
+                return numa_node_id();
+        }
+}
+
+// Charge an object of bytes to its container's limits, before it gets its
+// pages. Called with the object's mem_lock held.
+static int charge_oid(struct oid_node *oid_ptr, unsigned long bytes){
+
+        struct container *container = oid_ptr->container;
+        unsigned long max_objects = READ_ONCE(container->max_objects);
+        unsigned long max_bytes = READ_ONCE(container->max_bytes);
+
+        if (atomic_long_inc_return(&container->charged_objects) > max_objects && max_objects) {
+                atomic_long_dec(&container->charged_objects);
+                return -ENOMEM;
+        }
+        if (atomic_long_add_return(bytes, &container->charged_bytes) > max_bytes && max_bytes) {
+                atomic_long_sub(bytes, &container->charged_bytes);
+                atomic_long_dec(&container->charged_objects);
+                return -ENOMEM;
+        }
+        oid_ptr->charged = bytes;
+        return 0;
+}
+
+static void uncharge_oid(struct oid_node *oid_ptr){
+        atomic_long_dec(&oid_ptr->container->charged_objects);
+        atomic_long_sub(oid_ptr->charged, &oid_ptr->container->charged_bytes);
+        oid_ptr->charged = 0;
+}
+
+// Drop the object's references on its pages, called once no task maps the
+// object any more or when its container is torn down.
+void release_oid_pages(struct oid_node *oid_ptr){
+
+        struct container *container = oid_ptr->container;
+        struct page *page;
+        unsigned long i;
+
+        if (oid_ptr->pages == NULL)
+                return;
+        uncharge_oid(oid_ptr);
+
+        if (oid_ptr->packed) {
+                // A shared slab page only counts once its last user is gone,
+                // slab_lock keeps the check in line with the slab cursor
+                page = oid_ptr->pages[0];
+                mutex_lock(&container->slab_lock);
+                if (page_ref_count(page) == 1)
+                        account_pages(container, page, -1);
+                pool_free_pages(page_pool_of(container, page), page);
+                mutex_unlock(&container->slab_lock);
+                goto out;
+        }
+
+        for (i = 0; i < oid_ptr->nr_pages; i++) {
+                page = oid_ptr->pages[i];
+                // A huge page is referenced and accounted once, through its head
+                if (page == NULL || compound_head(page) != page)
+                        continue;
+                account_pages(container, page, -(long)compound_nr(page));
+                if (object_reclaimable(oid_ptr))
+                        atomic_long_dec(&stat_reclaimable_pages);
+                pool_free_pages(page_pool_of(container, page), page);
+        }
+        if (oid_ptr->zpages != NULL) {
+                for (i = 0; i < oid_ptr->nr_pages; i++) {
+                        if (oid_ptr->zpages[i] == NULL)
+                                continue;
+                        atomic_long_dec(&stat_compressed_pages);
+                        atomic_long_sub(oid_ptr->zpages[i]->len, &stat_compressed_bytes);
+                        kfree(oid_ptr->zpages[i]);
+                }
+                kfree(oid_ptr->zpages);
+                oid_ptr->zpages = NULL;
+        }
+out:
+        kvfree(oid_ptr->pages);
+        oid_ptr->pages = NULL;
+        oid_ptr->nr_pages = 0;
+        oid_ptr->offset = 0;
+        oid_ptr->packed = false;
+}
+
+// Last reference of an object is gone, it is unlinked already and no task
+// maps it any more
+static void oid_release(struct kref *ref){
+
+        struct oid_node *oid_ptr = container_of(ref, struct oid_node, ref);
+
+        release_ranges(oid_ptr, 0);
+        release_oid_pages(oid_ptr);
+        atomic_long_dec(&stat_objects);
+        // Lookups under RCU may still try to take a reference
+        kfree_rcu(oid_ptr, rcu);
+}
+
+void put_oid(struct oid_node *oid_ptr){
+        kref_put(&oid_ptr->ref, oid_release);
+}
+
+// Give a new object of size bytes a slot in the container's slab page
+// instead of a page of its own. Slots are not reused, a slab page goes back
+// to the pool once all of its objects are freed and unmapped. Returns the
+// object's offset in its first page, 0 for objects that are not packed.
+int small_alloc_in_container(struct container *container, __u64 oid, __u64 size){
+
+        struct oid_node *oid_ptr;
+        struct page **pages;
+        unsigned int slot;
+        int ret;
+
+        oid_ptr = get_oid_ptr_from_container(container, oid);
+        if (oid_ptr == NULL)
+                return -ENOMEM;
+
+        mutex_lock(&oid_ptr->mem_lock);
+        // An existing object keeps the placement it got first
+        if (oid_ptr->pages != NULL || !oid_ptr->attrs.small || size == 0 || size > SMALL_OBJECT_MAX) {
+                ret = oid_ptr->offset;
+                goto out;
+        }
+
+        slot = ALIGN(size, SMALL_OBJECT_ALIGN);
+        ret = charge_oid(oid_ptr, slot);
+        if (ret)
+                goto out;
+        pages = kvcalloc(1, sizeof(struct page *), GFP_KERNEL_ACCOUNT);
+        if (pages == NULL) {
+                uncharge_oid(oid_ptr);
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        mutex_lock(&container->slab_lock);
+        if (container->slab_page == NULL || container->slab_used + slot > PAGE_SIZE) {
+                // Start a new slab page, the old one lives on in its objects
+                if (container->slab_page != NULL) {
+                        if (page_ref_count(container->slab_page) == 1)
+                                account_pages(container, container->slab_page, -1);
+                        pool_free_pages(page_pool_of(container, container->slab_page), container->slab_page);
+                }
+                // The object opening a slab page picks its node
+                container->slab_page = pool_alloc_pages(&container->pools[oid_page_node(oid_ptr, 0)], GFP_HIGHUSER | __GFP_ACCOUNT, 0);
+                container->slab_used = 0;
+                if (container->slab_page == NULL) {
+                        mutex_unlock(&container->slab_lock);
+                        uncharge_oid(oid_ptr);
+                        kvfree(pages);
+                        ret = -ENOMEM;
+                        goto out;
+                }
+                account_pages(container, container->slab_page, 1);
+        }
+        get_page(container->slab_page);
+        pages[0] = container->slab_page;
+        oid_ptr->offset = container->slab_used;
+        container->slab_used += slot;
+        mutex_unlock(&container->slab_lock);
+
+        oid_ptr->pages = pages;
+        oid_ptr->nr_pages = 1;
+        oid_ptr->packed = true;
+        mark_header_packed(container, oid, oid_ptr->offset);
+        ret = oid_ptr->offset;
+out:
+        mutex_unlock(&oid_ptr->mem_lock);
+        put_oid(oid_ptr);
+        return ret;
+}
+
+// Arena slots hold no reference on their object, so a freed object leaves
+// them right away. A fault that found the object before it was marked dead
+// holds its page locked until the page table entry is in place, waiting for
+// each page lock lets the second zap catch that entry too.
+static void unmap_dead_oid(struct oid_node *oid_ptr){
+
+        unsigned long i;
+
+        mutex_lock(&oid_ptr->mem_lock);
+        oid_ptr->dead = true;
+        mutex_unlock(&oid_ptr->mem_lock);
+        zap_oid_arena(oid_ptr);
+
+        mutex_lock(&oid_ptr->mem_lock);
+        for (i = 0; oid_ptr->pages != NULL && i < oid_ptr->nr_pages; i++) {
+                if (oid_ptr->pages[i] != NULL) {
+                        lock_page(oid_ptr->pages[i]);
+                        unlock_page(oid_ptr->pages[i]);
+                }
+        }
+        mutex_unlock(&oid_ptr->mem_lock);
+        zap_oid_arena(oid_ptr);
+}
+
+int free_oid_in_container(struct container *container, __u64 oid){
+
+        struct oid_bucket *bucket;
+        struct oid_node *oid_ptr;
+        struct memory_container_header *header;
+        bool found = false;
+        u32 old;
+
+        header = get_header(container, oid);
+
+        // Unlink the object, the next mapping of this OID creates a new one
+        // printk("Trying to free Memory for OID: %llu in CID: %llu by PID %d\n", oid, container->cid, current->pid);
+        bucket = &container->oid_table[hash_64(oid, OID_HASH_BITS)];
+        mutex_lock(&bucket->lock);
+        hlist_for_each_entry(oid_ptr, &bucket->head, hnode) {
+                if (oid_ptr->oid == oid) {
+                        hlist_del_rcu(&oid_ptr->hnode);
+                        atomic_long_dec(&container->nr_objects);
+                        trace_mcontainer_free(container->cid, oid, READ_ONCE(oid_ptr->nr_pages) << PAGE_SHIFT, 0);
+                        found = true;
+                        break;
+                }
+        }
+        this_cpu_inc(container->counters->frees);
+        // Mappings cached by the library are stale from now on, and the
+        // next object of this OID is placed anew
+        if (header != NULL) {
+                WRITE_ONCE(header->generation, header->generation + 1);
+                do {
+                        old = READ_ONCE(header->flags);
+                } while ((old & MCONTAINER_HEADER_PACKED) &&
+                         cmpxchg(&header->flags, old, old & ~MCONTAINER_HEADER_PACKED) != old);
+        }
+        mutex_unlock(&bucket->lock);
+
+        // Pages go once the last task that maps the object unmaps it, its
+        // ranges right away so that nobody waits for them any more
+        if (found) {
+                release_ranges(oid_ptr, 0);
+                if (READ_ONCE(container->arena_orders))
+                        unmap_dead_oid(oid_ptr);
+                put_oid(oid_ptr);
+        }
+        // printk("Memory freed for OID: %llu in CID: %llu by PID %d\n", oid, container->cid, current->pid);
+        return 0;
+}
+
+// Live statistics under /proc/mcontainer: containers has a line per
+// container, tasks one per member task, hot_objects the HOT_OBJECTS objects
+// with the most operations that reached the kernel.
+static struct proc_dir_entry *proc_dir;
+
+// Object listed by hot_objects
+struct hot_object {
+        __u64 cid;
+        __u64 oid;
+        long nr_ops;
+        long nr_contended;
+        u64 wait_ns;
+        unsigned long size;
+};
+
+static void sum_counters(struct container *container, struct container_counters *sum){
+
+        struct container_counters *counters;
+        int cpu;
+
+        memset(sum, 0, sizeof(struct container_counters));
+        for_each_possible_cpu(cpu) {
+                counters = per_cpu_ptr(container->counters, cpu);
+                sum->mmaps += counters->mmaps;
+                sum->locks += counters->locks;
+                sum->unlocks += counters->unlocks;
+                sum->frees += counters->frees;
+                sum->contended += counters->contended;
+                sum->wait_ns += counters->wait_ns;
+        }
+}
+
+static int proc_containers_show(struct seq_file *m, void *v){
+
+        struct container_counters sum;
+        struct container *container;
+        int bkt;
+
+        seq_puts(m, "cid tasks objects resident_bytes mmaps locks unlocks frees contended lock_wait_ns\n");
+        mutex_lock(&container_table_lock);
+        hash_for_each(container_table, bkt, container, hnode) {
+                sum_counters(container, &sum);
+                seq_printf(m, "%llu %ld %ld %ld %llu %llu %llu %llu %llu %llu\n", container->cid,
+                           atomic_long_read(&container->nr_tasks),
+                           atomic_long_read(&container->nr_objects), atomic_long_read(&container->nr_pages) << PAGE_SHIFT,
+                           sum.mmaps, sum.locks, sum.unlocks, sum.frees, sum.contended, sum.wait_ns);
+        }
+        mutex_unlock(&container_table_lock);
+        return 0;
+}
+
+static int proc_tasks_show(struct seq_file *m, void *v){
+
+        struct pid_node *pid_ptr;
+        int bkt;
+
+        seq_puts(m, "pid tid cid\n");
+        // Containers are freed after a grace period, their CID stays readable
+        rcu_read_lock();
+        hash_for_each_rcu(task_table, bkt, pid_ptr, hnode)
+                seq_printf(m, "%d %u %llu\n", pid_ptr->pid, pid_ptr->tid, pid_ptr->container->cid);
+        rcu_read_unlock();
+        return 0;
+}
+
+static int proc_hot_objects_show(struct seq_file *m, void *v){
+
+        struct hot_object *hot;
+        struct container *container;
+        struct oid_node *oid_ptr;
+        long nr_ops;
+        int bkt, i, j, n = 0;
+
+        hot = kcalloc(HOT_OBJECTS, sizeof(struct hot_object), GFP_KERNEL);
+        if (hot == NULL)
+                return -ENOMEM;
+
+        mutex_lock(&container_table_lock);
+        hash_for_each(container_table, bkt, container, hnode) {
+                rcu_read_lock();
+                for (i = 0; i < (1 << OID_HASH_BITS); i++) {
+                        hlist_for_each_entry_rcu(oid_ptr, &container->oid_table[i].head, hnode) {
+                                nr_ops = atomic_long_read(&oid_ptr->nr_ops);
+                                if (nr_ops == 0 || (n == HOT_OBJECTS && nr_ops <= hot[n - 1].nr_ops))
+                                        continue;
+                                // Insert into the list, hottest first
+                                for (j = min(n, HOT_OBJECTS - 1); j > 0 && hot[j - 1].nr_ops < nr_ops; j--)
+                                        hot[j] = hot[j - 1];
+                                hot[j].cid = container->cid;
+                                hot[j].oid = oid_ptr->oid;
+                                hot[j].nr_ops = nr_ops;
+                                hot[j].nr_contended = atomic_long_read(&oid_ptr->nr_contended);
+                                hot[j].wait_ns = atomic64_read(&oid_ptr->wait_ns);
+                                hot[j].size = READ_ONCE(oid_ptr->nr_pages) << PAGE_SHIFT;
+                                if (n < HOT_OBJECTS)
+                                        n++;
+                        }
+                }
+                rcu_read_unlock();
+        }
+        mutex_unlock(&container_table_lock);
+
+        seq_puts(m, "cid oid ops contended lock_wait_ns size_bytes\n");
+        for (i = 0; i < n; i++)
+                seq_printf(m, "%llu %llu %ld %ld %llu %lu\n", hot[i].cid, hot[i].oid, hot[i].nr_ops,
+                           hot[i].nr_contended, hot[i].wait_ns, hot[i].size);
+        kfree(hot);
+        return 0;
+}
+
+// Cold objects are compressed under memory pressure. The shrinker sweeps the
+// OID buckets of all containers like a clock with two hands: the first visit
+// zaps the mappings of an object, if nothing faults it back in until the next
+// visit the object is cold and its unmapped pages are compressed. The fault
+// handler decompresses a page on its next access.
+
+// The compressor and its scratch buffer serve one page at a time
+static DEFINE_MUTEX(compress_lock);
+static struct crypto_comp *compress_tfm;
+static u8 *compress_buf;
+// OID bucket the clock hand is at, protected by container_table_lock
+static unsigned int shrink_bucket;
+
+// Compressed copy of a page, NULL unless it saves a quarter of the page
+static struct zpage* compress_page(struct page *page){
+
+        unsigned int len = 2 * PAGE_SIZE;
+        struct zpage *zpage = NULL;
+        void *src;
+
+        mutex_lock(&compress_lock);
+        src = kmap_local_page(page);
+        if (crypto_comp_compress(compress_tfm, src, PAGE_SIZE, compress_buf, &len) == 0 && len <= PAGE_SIZE - PAGE_SIZE / 4) {
+                // Reclaim must not recurse or wait here
+                zpage = kmalloc(sizeof(struct zpage) + len, GFP_NOWAIT | __GFP_NOWARN);
+                if (zpage != NULL) {
+                        zpage->len = len;
+                        memcpy(zpage->data, compress_buf, len);
+                }
+        }
+        kunmap_local(src);
+        mutex_unlock(&compress_lock);
+        return zpage;
+}
+
+static int decompress_page(struct zpage *zpage, struct page *page){
+
+        unsigned int len = PAGE_SIZE;
+        void *dst;
+        int ret;
+
+        mutex_lock(&compress_lock);
+        dst = kmap_local_page(page);
+        ret = crypto_comp_decompress(compress_tfm, zpage->data, zpage->len, dst, &len);
+        kunmap_local(dst);
+        mutex_unlock(&compress_lock);
+        if (ret == 0 && len != PAGE_SIZE)
+                ret = -EIO;
+        return ret;
+}
+
+// Drop the page table entries of the object's slots in every arena
+static void zap_oid_arena(struct oid_node *oid_ptr){
+
+        struct container *container = oid_ptr->container;
+        struct address_space *mapping = READ_ONCE(container->mapping);
+        unsigned long order;
+        pgoff_t pgoff;
+
+        if (mapping == NULL)
+                return;
+        for_each_set_bit(order, &container->arena_orders, BITS_PER_LONG) {
+                pgoff = MCONTAINER_MMAP_ARENA + (order << MCONTAINER_ARENA_ORDER_SHIFT) + (oid_ptr->oid << order);
+                unmap_mapping_range(mapping, (loff_t)pgoff << PAGE_SHIFT, (loff_t)PAGE_SIZE << order, 0);
+        }
+}
+
+// Drop every page table entry of the object, the next access faults. The
+// device has one mapping for all containers, so the same OID of other
+// containers is zapped as well and simply faults back in.
+static void zap_oid_mappings(struct oid_node *oid_ptr){
+
+        struct container *container = oid_ptr->container;
+        struct address_space *mapping = READ_ONCE(container->mapping);
+
+        if (mapping == NULL)
+                return;
+        unmap_mapping_range(mapping, (loff_t)oid_ptr->oid << PAGE_SHIFT, (loff_t)oid_ptr->nr_pages << PAGE_SHIFT, 0);
+        zap_oid_arena(oid_ptr);
+}
+
+// One visit of the clock hand at an object, returns the pages it freed.
+// Called with the object's bucket lock held.
+static unsigned long shrink_oid(struct oid_node *oid_ptr){
+
+        struct container *container = oid_ptr->container;
+        struct memory_container_header *header;
+        struct page *page;
+        struct zpage *zpage;
+        unsigned long i, freed = 0;
+        bool zap = false;
+
+        // The holder may be allocating, which is how we got here
+        if (!mutex_trylock(&oid_ptr->mem_lock))
+                return 0;
+
+        if (oid_ptr->pages == NULL || !object_reclaimable(oid_ptr))
+                goto out;
+
+        // A locked object is in use
+        header = peek_header(container, oid_ptr->oid);
+        if (header != NULL && READ_ONCE(header->lock) != 0)
+                goto out;
+
+        if (!oid_ptr->probed) {
+                // First hand, a fault from now on marks the object as used
+                oid_ptr->probed = true;
+                zap = true;
+                goto out;
+        }
+
+        if (oid_ptr->zpages == NULL) {
+                oid_ptr->zpages = kcalloc(oid_ptr->nr_pages, sizeof(struct zpage *), GFP_NOWAIT | __GFP_NOWARN);
+                if (oid_ptr->zpages == NULL)
+                        goto out;
+        }
+        for (i = 0; i < oid_ptr->nr_pages; i++) {
+                page = oid_ptr->pages[i];
+                // A page mapped again holds a reference per page table entry
+                if (page == NULL || page_count(page) != 1)
+                        continue;
+                zpage = compress_page(page);
+                if (zpage == NULL)
+                        continue;
+                oid_ptr->zpages[i] = zpage;
+                oid_ptr->pages[i] = NULL;
+                account_pages(container, page, -1);
+                atomic_long_dec(&stat_reclaimable_pages);
+                atomic_long_inc(&stat_compressed_pages);
+                atomic_long_add(zpage->len, &stat_compressed_bytes);
+                // Back to the system, the pool would keep it pinned
+                put_page(page);
+                freed++;
+        }
+out:
+        mutex_unlock(&oid_ptr->mem_lock);
+        if (zap)
+                zap_oid_mappings(oid_ptr);
+        return freed;
+}
+
+static unsigned long memory_container_shrink_count(struct shrinker *shrinker, struct shrink_control *sc){
+
+        long nr_pages = atomic_long_read(&stat_reclaimable_pages);
+
+        return nr_pages > 0 ? nr_pages : SHRINK_EMPTY;
+}
+
+static unsigned long memory_container_shrink_scan(struct shrinker *shrinker, struct shrink_control *sc){
+
+        struct container *container;
+        struct oid_bucket *bucket;
+        struct oid_node *oid_ptr;
+        unsigned long freed = 0, scanned = 0;
+        unsigned int step, index;
+        int bkt;
+
+        // Allocations under any of these locks may have got us here, so
+        // whatever is busy is skipped
+        if (!mutex_trylock(&container_table_lock))
+                return SHRINK_STOP;
+
+        for (step = 0; step < (1 << OID_HASH_BITS) && scanned < sc->nr_to_scan; step++) {
+                index = shrink_bucket++ & ((1 << OID_HASH_BITS) - 1);
+                hash_for_each(container_table, bkt, container, hnode) {
+                        bucket = &container->oid_table[index];
+                        if (!mutex_trylock(&bucket->lock))
+                                continue;
+                        hlist_for_each_entry(oid_ptr, &bucket->head, hnode) {
+                                freed += shrink_oid(oid_ptr);
+                                scanned += oid_ptr->nr_pages;
+                        }
+                        mutex_unlock(&bucket->lock);
+                }
+        }
+        mutex_unlock(&container_table_lock);
+
+        sc->nr_scanned = scanned;
+        return freed;
+}
+
+// The core allocates shrinkers from 6.7 on, and names them from 6.0 on
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *memory_container_shrinker;
+
+static int register_memory_container_shrinker(void){
+
+        memory_container_shrinker = shrinker_alloc(0, "memory_container");
+        if (memory_container_shrinker == NULL)
+                return -ENOMEM;
+        memory_container_shrinker->count_objects = memory_container_shrink_count;
+        memory_container_shrinker->scan_objects = memory_container_shrink_scan;
+        memory_container_shrinker->seeks = DEFAULT_SEEKS;
+        shrinker_register(memory_container_shrinker);
+        return 0;
+}
+
+static void unregister_memory_container_shrinker(void){
+        shrinker_free(memory_container_shrinker);
+}
+#else
+static struct shrinker memory_container_shrinker = {
+        .count_objects = memory_container_shrink_count,
+        .scan_objects = memory_container_shrink_scan,
+        .seeks = DEFAULT_SEEKS,
+};
+
+static int register_memory_container_shrinker(void){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+        return register_shrinker(&memory_container_shrinker, "memory_container");
+#else
+        return register_shrinker(&memory_container_shrinker);
+#endif
+}
+
+static void unregister_memory_container_shrinker(void){
+        unregister_shrinker(&memory_container_shrinker);
+}
+#endif
+
+void init_all_ds() {
+
+        int i;
+
+        for (i = 0; i < (1 << LOCK_WAIT_BITS); i++) {
+                init_waitqueue_head(&lock_waitqueues[i]);
+                spin_lock_init(&lock_queues[i].lock);
+                INIT_LIST_HEAD(&lock_queues[i].waiters);
+        }
+
+        // Statistics are optional, the device works without them
+        proc_dir = proc_mkdir("mcontainer", NULL);
+        if (proc_dir != NULL) {
+                proc_create_single("containers", 0444, proc_dir, proc_containers_show);
+                proc_create_single("tasks", 0444, proc_dir, proc_tasks_show);
+                proc_create_single("hot_objects", 0444, proc_dir, proc_hot_objects_show);
+        }
+
+        // Without a compressor objects simply stay resident
+        if (compress_algo[0] == '\0')
+                return;
+        compress_tfm = crypto_alloc_comp(compress_algo, 0, 0);
+        if (IS_ERR(compress_tfm)) {
+                printk(KERN_WARNING "memory_container: no %s compressor, cold objects stay resident\n", compress_algo);
+                compress_tfm = NULL;
+                return;
+        }
+        // Room for what the compressor writes for an incompressible page
+        compress_buf = kmalloc(2 * PAGE_SIZE, GFP_KERNEL);
+        if (compress_buf == NULL || register_memory_container_shrinker()) {
+                kfree(compress_buf);
+                compress_buf = NULL;
+                crypto_free_comp(compress_tfm);
+                compress_tfm = NULL;
+        }
+}
+
+void free_all_ds() {
+
+        // printk("Start freeing everything\n");
+        // Iterate over the tables and kfree everything
+
+        // For containers and their OIDs
+        struct container *container;
+        struct hlist_node *tmp_container;
+        int bkt;
+        // For PID table
+        struct pid_node *pid_ptr;
+        struct hlist_node *tmp_pid;
+
+        proc_remove(proc_dir);
+        if (compress_tfm != NULL)
+                unregister_memory_container_shrinker();
+
+        // No task can use the device any more, references do not matter
+        hash_for_each_safe(container_table, bkt, tmp_container, container, hnode) {
+                hash_del(&container->hnode);
+                destroy_container(container);
+        }
+
+        hash_for_each_safe(task_table, bkt, tmp_pid, pid_ptr, hnode) {
+                hash_del(&pid_ptr->hnode);
+                kfree(pid_ptr);
+        }
+
+        // Compressed pages went with their objects
+        if (compress_tfm != NULL) {
+                crypto_free_comp(compress_tfm);
+                compress_tfm = NULL;
+                kfree(compress_buf);
+                compress_buf = NULL;
+        }
+        // printk("Done freeing everything\n");
+}
+
+// Map page index of the object at the faulting address. Called with the
+// object's mem_lock held.
+static vm_fault_t oid_fault_page(struct vm_fault *vmf, struct oid_node *oid_ptr, unsigned long index)
+{
+        struct page *page;
+        struct zpage *zpage;
+
+        if (oid_ptr->pages == NULL || index >= oid_ptr->nr_pages) {
+                // An arena slot reaches past a smaller object, or a VMA past
+                // the end of the object
+                return VM_FAULT_SIGBUS;
+        }
+
+        page = oid_ptr->pages[index];
+        if (page == NULL) {
+                // First touch of this page by any task in the container
+                page = pool_alloc_pages(&oid_ptr->container->pools[oid_page_node(oid_ptr, index)], GFP_HIGHUSER | __GFP_ACCOUNT, 0);
+                if (page == NULL)
+                        return VM_FAULT_OOM;
+                // The page may have been compressed while the object was cold
+                zpage = oid_ptr->zpages != NULL ? oid_ptr->zpages[index] : NULL;
+                if (zpage != NULL) {
+                        if (decompress_page(zpage, page)) {
+                                pool_free_pages(page_pool_of(oid_ptr->container, page), page);
+                                return VM_FAULT_SIGBUS;
+                        }
+                        oid_ptr->zpages[index] = NULL;
+                        atomic_long_dec(&stat_compressed_pages);
+                        atomic_long_sub(zpage->len, &stat_compressed_bytes);
+                        kfree(zpage);
+                }
+                oid_ptr->pages[index] = page;
+                account_pages(oid_ptr->container, page, 1);
+                if (object_reclaimable(oid_ptr))
+                        atomic_long_inc(&stat_reclaimable_pages);
+        }
+        // The object is in use, the shrinker starts over with it
+        oid_ptr->probed = false;
+        atomic_long_inc(&oid_ptr->nr_ops);
+
+        // The reference is handed to the page table entry
+        get_page(page);
+        vmf->page = page;
+        return 0;
+}
+
+static vm_fault_t memory_container_fault(struct vm_fault *vmf)
+{
+        struct vm_area_struct *vma = vmf->vma;
+        struct oid_node *oid_ptr = vma->vm_private_data;
+        unsigned long index;
+        vm_fault_t ret;
+
+        // Page of the object being touched. The VMA may have been split, its
+        // start is not the start of the object then, and the page offset
+        // is the OID followed by the page index. Past the end of the
+        // object oid_fault_page() fails.
+        index = vmf->pgoff - oid_ptr->oid;
+
+        mutex_lock(&oid_ptr->mem_lock);
+        ret = oid_fault_page(vmf, oid_ptr, index);
+        mutex_unlock(&oid_ptr->mem_lock);
+        return ret;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+// The page table level comes as an order from 6.6 on
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+static vm_fault_t memory_container_huge_fault(struct vm_fault *vmf, unsigned int order)
+#else
+static vm_fault_t memory_container_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+#endif
+{
+        struct vm_area_struct *vma = vmf->vma;
+        struct oid_node *oid_ptr = vma->vm_private_data;
+        unsigned long haddr = vmf->address & HPAGE_PMD_MASK;
+        unsigned long index, i;
+        struct page *page;
+        vm_fault_t ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+        if (order != HPAGE_PMD_ORDER)
+                return VM_FAULT_FALLBACK;
+#else
+        if (pe_size != PE_SIZE_PMD)
+                return VM_FAULT_FALLBACK;
+#endif
+
+        // The huge page has to sit inside the VMA, on a chunk boundary of
+        // the object, otherwise the 4 KB handler maps it
+        if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+                return VM_FAULT_FALLBACK;
+        index = vma->vm_pgoff - oid_ptr->oid + ((haddr - vma->vm_start) >> PAGE_SHIFT);
+        if (!IS_ALIGNED(index, HPAGE_PMD_NR))
+                return VM_FAULT_FALLBACK;
+
+        mutex_lock(&oid_ptr->mem_lock);
+        if (!oid_ptr->attrs.hugepage || oid_ptr->pages == NULL || index + HPAGE_PMD_NR > oid_ptr->nr_pages) {
+                ret = VM_FAULT_FALLBACK;
+                goto out;
+        }
+
+        page = oid_ptr->pages[index];
+        if (page == NULL) {
+                // Only an untouched chunk can become a huge page
+                for (i = 1; i < HPAGE_PMD_NR; i++) {
+                        if (oid_ptr->pages[index + i] != NULL) {
+                                ret = VM_FAULT_FALLBACK;
+                                goto out;
+                        }
+                }
+
+                // Do not compact hard for it, 4 KB pages are the fallback
+                page = pool_alloc_pages(&oid_ptr->container->pools[oid_page_node(oid_ptr, index)], GFP_HIGHUSER | __GFP_ACCOUNT | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY, HPAGE_PMD_ORDER);
+                if (page == NULL) {
+                        ret = VM_FAULT_FALLBACK;
+                        goto out;
+                }
+                for (i = 0; i < HPAGE_PMD_NR; i++)
+                        oid_ptr->pages[index + i] = page + i;
+                account_pages(oid_ptr->container, page, HPAGE_PMD_NR);
+        } else if (!PageHead(page) || compound_order(page) != HPAGE_PMD_ORDER) {
+                // Chunk was already populated with 4 KB pages
+                ret = VM_FAULT_FALLBACK;
+                goto out;
+        }
+
+        // The PMD entry is a special mapping and holds no page reference
+        ret = vmf_insert_pfn_pmd(vmf, page_to_pmd_pfn(page), vmf->flags & FAULT_FLAG_WRITE);
+out:
+        mutex_unlock(&oid_ptr->mem_lock);
+        return ret;
+}
+#endif
+
+// Every VMA, also one split off or copied on fork, holds a reference on
+// its container, and an object's VMA on the object too
+static void memory_container_vm_open(struct vm_area_struct *vma)
+{
+        struct oid_node *oid_ptr = vma->vm_private_data;
+        kref_get(&oid_ptr->ref);
+        kref_get(&oid_ptr->container->ref);
+}
+
+// The object may go first, it returns its pages to the container's pool
+static void memory_container_vm_close(struct vm_area_struct *vma)
+{
+        struct oid_node *oid_ptr = vma->vm_private_data;
+        struct container *container = oid_ptr->container;
+
+        put_oid(oid_ptr);
+        put_container(container);
+}
+
+static void memory_container_container_vm_open(struct vm_area_struct *vma)
+{
+        struct container *container = vma->vm_private_data;
+        kref_get(&container->ref);
+}
+
+static void memory_container_container_vm_close(struct vm_area_struct *vma)
+{
+        struct container *container = vma->vm_private_data;
+        put_container(container);
+}
+
+static const struct vm_operations_struct memory_container_vm_ops = {
+        .open = memory_container_vm_open,
+        .close = memory_container_vm_close,
+        .fault = memory_container_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+        .huge_fault = memory_container_huge_fault,
+#endif
+};
+
+/**
+ * Place mappings of PMD size or more on a PMD boundary so that huge page
+ * backed objects can be mapped with PMD entries.
+ */
+unsigned long memory_container_get_unmapped_area(struct file *filp, unsigned long addr,
+                                                 unsigned long len, unsigned long pgoff,
+                                                 unsigned long flags)
+{
+        unsigned long ret;
+
+        if (addr || (flags & MAP_FIXED) || len < PMD_SIZE || len + PMD_SIZE < len)
+                return mm_unmapped_area(filp, addr, len, pgoff, flags);
+
+        // Ask for one PMD more than needed and align inside it
+        ret = mm_unmapped_area(filp, 0, len + PMD_SIZE, 0, flags);
+        if (IS_ERR_VALUE(ret))
+                return mm_unmapped_area(filp, addr, len, pgoff, flags);
+        return ALIGN(ret, PMD_SIZE);
+}
+
+static vm_fault_t memory_container_header_fault(struct vm_fault *vmf)
+{
+        struct vm_area_struct *vma = vmf->vma;
+        struct container *container = vma->vm_private_data;
+        unsigned long index;
+        struct page *page;
+
+        // Header page of the container being touched
+        index = vma->vm_pgoff - MCONTAINER_MMAP_HEADER + ((vmf->address - vma->vm_start) >> PAGE_SHIFT);
+
+        page = get_header_page(container, index);
+        if (page == NULL)
+                return VM_FAULT_OOM;
+
+        get_page(page);
+        vmf->page = page;
+        return 0;
+}
+
+static const struct vm_operations_struct memory_container_header_vm_ops = {
+        .open = memory_container_container_vm_open,
+        .close = memory_container_container_vm_close,
+        .fault = memory_container_header_fault,
+};
+
+// Map the container's header pages, so that user space can take and
+// release uncontended locks without a system call
+int memory_container_mmap_header(struct container *container, struct vm_area_struct *vma)
+{
+        // Private copies would not see the other tasks' lock words
+        if (!(vma->vm_flags & VM_SHARED))
+                return -EINVAL;
+
+        vma->vm_ops = &memory_container_header_vm_ops;
+        vma->vm_private_data = container;
+        set_vma_flags(vma, VM_DONTEXPAND | VM_DONTDUMP);
+        return 0;
+}
+
+static vm_fault_t memory_container_arena_fault(struct vm_fault *vmf)
+{
+        struct vm_area_struct *vma = vmf->vma;
+        struct container *container = vma->vm_private_data;
+        unsigned int order = (vma->vm_pgoff >> MCONTAINER_ARENA_ORDER_SHIFT) & 0xff;
+        struct oid_node *oid_ptr;
+        struct page **pages;
+        unsigned long index;
+        vm_fault_t ret;
+
+        // Every object owns a slot of 2^order pages, starting with OID 0.
+        // A split VMA starts further in, the page offset says where.
+        index = vmf->pgoff - (MCONTAINER_MMAP_ARENA + ((unsigned long)order << MCONTAINER_ARENA_ORDER_SHIFT));
+        if (index >= (1UL << MCONTAINER_ARENA_ORDER_SHIFT))
+                return VM_FAULT_SIGBUS;
+again:
+        oid_ptr = get_oid_ptr_from_container(container, index >> order);
+        if (oid_ptr == NULL)
+                return VM_FAULT_OOM;
+
+        mutex_lock(&oid_ptr->mem_lock);
+        // Freed since the lookup, the slot belongs to a new object
+        if (oid_ptr->dead) {
+                mutex_unlock(&oid_ptr->mem_lock);
+                put_oid(oid_ptr);
+                goto again;
+        }
+        if (oid_ptr->pages == NULL) {
+                // Touching the slot creates the object with the slot size, a
+                // container over its limits gets no new objects
+                if (charge_oid(oid_ptr, PAGE_SIZE << order)) {
+                        mutex_unlock(&oid_ptr->mem_lock);
+                        put_oid(oid_ptr);
+                        return VM_FAULT_SIGBUS;
+                }
+                pages = kvcalloc(1UL << order, sizeof(struct page *), GFP_KERNEL_ACCOUNT);
+                if (pages == NULL) {
+                        uncharge_oid(oid_ptr);
+                        mutex_unlock(&oid_ptr->mem_lock);
+                        put_oid(oid_ptr);
+                        return VM_FAULT_OOM;
+                }
+                oid_ptr->pages = pages;
+                oid_ptr->nr_pages = 1UL << order;
+        }
+        ret = oid_fault_page(vmf, oid_ptr, index & ((1UL << order) - 1));
+        // Locked until the entry is in place, see unmap_dead_oid()
+        if (ret == 0) {
+                lock_page(vmf->page);
+                ret = VM_FAULT_LOCKED;
+        }
+        mutex_unlock(&oid_ptr->mem_lock);
+        put_oid(oid_ptr);
+        return ret;
+}
+
+static const struct vm_operations_struct memory_container_arena_vm_ops = {
+        .open = memory_container_container_vm_open,
+        .close = memory_container_container_vm_close,
+        .fault = memory_container_arena_fault,
+};
+
+// Map a window over all objects of the container at once, so that a task
+// touching many objects needs a single VMA
+int memory_container_mmap_arena(struct container *container, struct vm_area_struct *vma)
+{
+        unsigned long order = (vma->vm_pgoff >> MCONTAINER_ARENA_ORDER_SHIFT) & 0xff;
+
+        if (!(vma->vm_flags & VM_SHARED))
+                return -EINVAL;
+        // Offset bits below the order are reserved, and slots of more than
+        // 4 GB would not leave room for many objects anyway
+        if ((vma->vm_pgoff & ((1UL << MCONTAINER_ARENA_ORDER_SHIFT) - 1)) || order > 20)
+                return -EINVAL;
+
+        vma->vm_ops = &memory_container_arena_vm_ops;
+        vma->vm_private_data = container;
+        set_bit(order, &container->arena_orders);
+        set_vma_flags(vma, VM_DONTEXPAND | VM_DONTDUMP);
+        return 0;
+}
+
+static const struct vm_operations_struct memory_container_holds_vm_ops = {
+        .open = memory_container_container_vm_open,
+        .close = memory_container_container_vm_close,
+};
+
+// Map the hold log of the calling task. Each task maps its own, a forked
+// child does not inherit the mapping.
+int memory_container_mmap_holds(struct container *container, struct vm_area_struct *vma)
+{
+        struct pid_node *pid_ptr;
+        int ret = -EINVAL;
+
+        if (!(vma->vm_flags & VM_SHARED) || vma_pages(vma) != 1)
+                return -EINVAL;
+
+        set_vma_flags(vma, VM_DONTCOPY | VM_DONTEXPAND | VM_DONTDUMP);
+
+        mutex_lock(&task_table_lock);
+        hash_for_each_possible(task_table, pid_ptr, hnode, current->pid) {
+                if (pid_ptr->pid == current->pid) {
+                        if (pid_ptr->holds == NULL)
+                                pid_ptr->holds = alloc_page(GFP_KERNEL_ACCOUNT | __GFP_ZERO);
+                        ret = pid_ptr->holds != NULL ? vm_insert_page(vma, vma->vm_start, pid_ptr->holds) : -ENOMEM;
+                        break;
+                }
+        }
+        mutex_unlock(&task_table_lock);
+        if (ret)
+                return ret;
+
+        vma->vm_ops = &memory_container_holds_vm_ops;
+        vma->vm_private_data = container;
+        return 0;
+}
+
+// Map a single object, the offset is its OID
+int memory_container_mmap_object(struct container *container, struct vm_area_struct *vma)
+{
+        struct page **pages;
+        unsigned long nr_pages;
+        struct oid_node *oid_ptr;
+
+        // Get OID reference for given container
+        oid_ptr = get_oid_ptr_from_container(container, (__u64)vma->vm_pgoff);
+        if (oid_ptr == NULL)
+                return -ENOMEM;
+
+        // Calculate requested number of pages
+        nr_pages = vma_pages(vma);
+
+        mutex_lock(&oid_ptr->mem_lock);
+        if (oid_ptr->pages == NULL) {
+                // First mapping decides the object size, only the page table
+                // is allocated here, pages come in through the fault handler
+                // printk("Assigning new mem for OID: %ld from PID: %d\n", vma->vm_pgoff, current->pid);
+                if (charge_oid(oid_ptr, nr_pages << PAGE_SHIFT)) {
+                        mutex_unlock(&oid_ptr->mem_lock);
+                        put_oid(oid_ptr);
+                        return -ENOMEM;
+                }
+                pages = kvcalloc(nr_pages, sizeof(struct page *), GFP_KERNEL_ACCOUNT);
+                if (pages == NULL) {
+                        uncharge_oid(oid_ptr);
+                        mutex_unlock(&oid_ptr->mem_lock);
+                        put_oid(oid_ptr);
+                        return -ENOMEM;
+                }
+                oid_ptr->pages = pages;
+                oid_ptr->nr_pages = nr_pages;
+        } else if (nr_pages > oid_ptr->nr_pages) {
+                // Mapping past the end of the existing object
+                mutex_unlock(&oid_ptr->mem_lock);
+                put_oid(oid_ptr);
+                return -EINVAL;
+        }
+        mutex_unlock(&oid_ptr->mem_lock);
+
+        // printk("Mapping OID: %ld with %lu pages for PID: %d\n", vma->vm_pgoff, nr_pages, current->pid);
+        // The lookup's reference on the object now belongs to the VMA
+        atomic_long_inc(&oid_ptr->nr_ops);
+        vma->vm_ops = &memory_container_vm_ops;
+        vma->vm_private_data = oid_ptr;
+        set_vma_flags(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+        // Huge pages are inserted as PFN mappings next to regular pages
+        if (oid_ptr->attrs.hugepage && nr_pages >= HPAGE_PMD_NR)
+                set_vma_flags(vma, VM_MIXEDMAP | VM_HUGEPAGE);
+#endif
+        return 0;
+}
+
+int memory_container_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+        struct container *container;
+        int ret;
+
+        // Get the container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+        // All opens of the device share one mapping
+        WRITE_ONCE(container->mapping, filp->f_mapping);
+
+        switch (vma->vm_pgoff >> MCONTAINER_MMAP_TYPE_SHIFT) {
+        case 0:
+                ret = memory_container_mmap_object(container, vma);
+                break;
+        case MCONTAINER_MMAP_HEADER >> MCONTAINER_MMAP_TYPE_SHIFT:
+                ret = memory_container_mmap_header(container, vma);
+                break;
+        case MCONTAINER_MMAP_ARENA >> MCONTAINER_MMAP_TYPE_SHIFT:
+                ret = memory_container_mmap_arena(container, vma);
+                break;
+        case MCONTAINER_MMAP_HOLDS >> MCONTAINER_MMAP_TYPE_SHIFT:
+                ret = memory_container_mmap_holds(container, vma);
+                break;
+        default:
+                ret = -EINVAL;
+        }
+
+        trace_mcontainer_mmap(container->cid, vma->vm_pgoff, vma->vm_end - vma->vm_start, ret);
+        // A successful mapping keeps the reference until it is closed
+        if (ret)
+                put_container(container);
+        else
+                this_cpu_inc(container->counters->mmaps);
+        return ret;
+}
+
+int memory_container_lock(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_LOCK, MAX_SCHEDULE_TIMEOUT);
+        put_container(container);
+        return ret;
+}
+
+int memory_container_unlock(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_UNLOCK, MAX_SCHEDULE_TIMEOUT);
+        put_container(container);
+        return ret;
+}
+
+// Relative timeout of a timed lock in nanoseconds. A signal ends the wait with
+// -EINTR, restarting it would start the whole timeout again.
+static long lock_timeout(__u64 timeout_ns){
+
+        unsigned long ret = nsecs_to_jiffies(timeout_ns);
+
+        if (ret >= MAX_SCHEDULE_TIMEOUT)
+                return MAX_SCHEDULE_TIMEOUT - 1;
+        // Round a short nonzero timeout up so it still sleeps once
+        return ret == 0 && timeout_ns ? 1 : ret;
+}
+
+int memory_container_trylock(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_LOCK, 0);
+        put_container(container);
+        return ret;
+}
+
+int memory_container_timedlock(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_LOCK,
+                                           lock_timeout(user_cmd_kernal.timeout));
+        put_container(container);
+        return ret == -ERESTARTSYS ? -EINTR : ret;
+}
+
+int memory_container_rdlock(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_RDLOCK, MAX_SCHEDULE_TIMEOUT);
+        put_container(container);
+        return ret;
+}
+
+int memory_container_rdunlock(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_RDUNLOCK, MAX_SCHEDULE_TIMEOUT);
+        put_container(container);
+        return ret;
+}
+
+// Apply one attribute to either the container defaults or a single object
+int set_object_attr(struct object_attrs *attrs, __u64 attr, __u64 value){
+
+        switch (attr) {
+        case MCONTAINER_ATTR_HUGEPAGE:
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+                attrs->hugepage = !!value;
+                return 0;
+#else
+                return -EOPNOTSUPP;
+#endif
+        case MCONTAINER_ATTR_SMALL_OBJECTS:
+                attrs->small = !!value;
+                return 0;
+        case MCONTAINER_ATTR_NUMA_POLICY:
+                if (value > MCONTAINER_NUMA_INTERLEAVE)
+                        return -EINVAL;
+                attrs->numa_policy = value;
+                return 0;
+        case MCONTAINER_ATTR_NUMA_NODE:
+                if (value >= nr_node_ids || !node_state(value, N_MEMORY))
+                        return -EINVAL;
+                attrs->numa_node = value;
+                return 0;
+        case MCONTAINER_ATTR_SEQLOCK:
+                attrs->seqlock = !!value;
+                return 0;
+        case MCONTAINER_ATTR_LOCK_POLICY:
+                if (value > MCONTAINER_LOCK_POLICY_FAIR)
+                        return -EINVAL;
+                attrs->lock_policy = value;
+                return 0;
+        default:
+                return -EINVAL;
+        }
+}
+
+// Value of one attribute of the container defaults
+int get_object_attr(struct object_attrs *attrs, __u64 attr){
+
+        switch (attr) {
+        case MCONTAINER_ATTR_HUGEPAGE:
+                return attrs->hugepage;
+        case MCONTAINER_ATTR_SMALL_OBJECTS:
+                return attrs->small;
+        case MCONTAINER_ATTR_NUMA_POLICY:
+                return attrs->numa_policy;
+        case MCONTAINER_ATTR_NUMA_NODE:
+                return attrs->numa_node;
+        case MCONTAINER_ATTR_SEQLOCK:
+                return attrs->seqlock;
+        case MCONTAINER_ATTR_LOCK_POLICY:
+                return attrs->lock_policy;
+        default:
+                return -EINVAL;
+        }
+}
+
+int memory_container_get_container_attr(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        spin_lock(&container->attrs_lock);
+        ret = get_object_attr(&container->attrs, user_cmd_kernal.op);
+        spin_unlock(&container->attrs_lock);
+        put_container(container);
+        return ret;
+}
+
+int memory_container_set_container_attr(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        // Only objects created from now on pick up the new default
+        spin_lock(&container->attrs_lock);
+        ret = set_object_attr(&container->attrs, user_cmd_kernal.op, user_cmd_kernal.value);
+        spin_unlock(&container->attrs_lock);
+        put_container(container);
+        return ret;
+}
+
+// Limit the objects or bytes of the caller's container. Objects that already
+// have their size stay, only new ones are refused.
+int memory_container_set_limit(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret = 0;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        switch (user_cmd_kernal.op) {
+        case MCONTAINER_LIMIT_OBJECTS:
+                WRITE_ONCE(container->max_objects, user_cmd_kernal.value);
+                break;
+        case MCONTAINER_LIMIT_BYTES:
+                WRITE_ONCE(container->max_bytes, user_cmd_kernal.value);
+                break;
+        default:
+                ret = -EINVAL;
+        }
+        put_container(container);
+        return ret;
+}
+
+int memory_container_lock_range(struct memory_container_range __user *user_range)
+{
+        struct container *container;
+        struct memory_container_range range;
+        int ret;
+
+        if (copy_from_user(&range, (void *)user_range, sizeof(struct memory_container_range)))
+                return -EFAULT;
+
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = lock_range_in_container(container, range.oid, range.offset, range.length);
+        put_container(container);
+        return ret;
+}
+
+int memory_container_unlock_range(struct memory_container_range __user *user_range)
+{
+        struct container *container;
+        struct memory_container_range range;
+        int ret;
+
+        if (copy_from_user(&range, (void *)user_range, sizeof(struct memory_container_range)))
+                return -EFAULT;
+
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = unlock_range_in_container(container, range.oid, range.offset, range.length);
+        put_container(container);
+        return ret;
+}
+
+int memory_container_set_object_attr(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        struct memory_container_header *header;
+        struct oid_node *oid_ptr;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        oid_ptr = get_oid_ptr_from_container(container, user_cmd_kernal.oid);
+        if (oid_ptr == NULL) {
+                put_container(container);
+                return -ENOMEM;
+        }
+
+        // Backing is decided by the first mapping, too late to change it after.
+        // Queued writers of a held lock would miss their hand over.
+        mutex_lock(&oid_ptr->mem_lock);
+        header = peek_header(container, oid_ptr->oid);
+        if (oid_ptr->pages != NULL) {
+                ret = -EBUSY;
+        } else if (user_cmd_kernal.op == MCONTAINER_ATTR_LOCK_POLICY && header != NULL && READ_ONCE(header->lock)) {
+                ret = -EBUSY;
+        } else if (user_cmd_kernal.op == MCONTAINER_ATTR_SEQLOCK) {
+                // Held ranges would write without moving the count
+                spin_lock(&oid_ptr->range_lock);
+                if (user_cmd_kernal.value && !RB_EMPTY_ROOT(&oid_ptr->ranges.rb_root))
+                        ret = -EBUSY;
+                else
+                        ret = set_object_attr(&oid_ptr->attrs, user_cmd_kernal.op, user_cmd_kernal.value);
+                spin_unlock(&oid_ptr->range_lock);
+        } else {
+                ret = set_object_attr(&oid_ptr->attrs, user_cmd_kernal.op, user_cmd_kernal.value);
+        }
+        if (ret == 0 && (user_cmd_kernal.op == MCONTAINER_ATTR_SEQLOCK || user_cmd_kernal.op == MCONTAINER_ATTR_LOCK_POLICY))
+                update_header_flags(container, oid_ptr->oid, &oid_ptr->attrs);
+        mutex_unlock(&oid_ptr->mem_lock);
+        put_oid(oid_ptr);
+        put_container(container);
+        return ret;
+}
+
+int memory_container_delete(struct memory_container_cmd __user *user_cmd)
+{
+        // Delete the PID from list
+        remove_pid_node(current->pid);
+        return 0;
+}
+
+int memory_container_create(struct file *filp, struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Find the container, creating it for the first task of this CID
+        container = get_container(user_cmd_kernal.cid);
+        if (container == NULL)
+                return -ENOMEM;
+
+        // Add the PID:container mapping node
+        return add_pid_node(current->pid, container, filp->private_data);
+}
+
+int memory_container_get_stats(struct memory_container_stats __user *user_stats)
+{
+        struct memory_container_stats stats;
+        int nid;
+
+        memset(&stats, 0, sizeof(stats));
+        stats.containers = atomic_long_read(&stat_containers);
+        stats.objects = atomic_long_read(&stat_objects);
+        stats.pages = atomic_long_read(&stat_pages);
+        stats.reclaimed_containers = atomic_long_read(&stat_reclaimed_containers);
+        stats.reclaimed_pages = atomic_long_read(&stat_reclaimed_pages);
+        stats.compressed_pages = atomic_long_read(&stat_compressed_pages);
+        stats.compressed_bytes = atomic_long_read(&stat_compressed_bytes);
+        stats.nr_nodes = min_t(int, nr_node_ids, MCONTAINER_STATS_NODES);
+        for_each_node(nid) {
+                if (nid < MCONTAINER_STATS_NODES)
+                        stats.node_bytes[nid] = atomic_long_read(&stat_node_pages[nid]) << PAGE_SHIFT;
+        }
+
+        if (copy_to_user(user_stats, &stats, sizeof(struct memory_container_stats)))
+                return -EFAULT;
+        return 0;
+}
+
+int memory_container_small_alloc(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = small_alloc_in_container(container, user_cmd_kernal.oid, user_cmd_kernal.value);
+        put_container(container);
+        return ret;
+}
+
+int memory_container_free(struct memory_container_cmd __user *user_cmd)
+{
+        struct container *container;
+        struct memory_container_cmd user_cmd_kernal;
+        int ret;
+
+        // Get OID from user_cmd
+        if (copy_from_user(&user_cmd_kernal, (void *)user_cmd, sizeof(struct memory_container_cmd)))
+                return -EFAULT;
+
+        // Get the container for PID
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        ret = free_oid_in_container(container, user_cmd_kernal.oid);
+        put_container(container);
+        return ret;
+}
+
+long memory_container_batch(struct file *filp, struct memory_container_batch __user *user_batch)
+{
+        struct container *container;
+        struct memory_container_batch batch;
+        struct memory_container_cmd __user *cmds;
+        struct memory_container_cmd user_cmd_kernal;
+        __s64 __user *results;
+        __s64 result;
+        __s64 offset;
+        __u64 i;
+        long ret;
+
+        if (copy_from_user(&batch, (void *)user_batch, sizeof(struct memory_container_batch)))
+                return -EFAULT;
+        if (batch.count > MCONTAINER_BATCH_MAX)
+                return -E2BIG;
+
+        // Get container for PID, once for the whole batch
+        container = get_container_for_pid(current->pid);
+        if (container == NULL)
+                return -EINVAL;
+
+        cmds = u64_to_user_ptr(batch.cmds);
+        results = u64_to_user_ptr(batch.results);
+
+        for (i = 0; i < batch.count; i++) {
+                // A killed task stops at once, the others give up the CPU
+                // between commands of a long batch
+                if (fatal_signal_pending(current)) {
+                        ret = i ? i : -EINTR;
+                        goto out;
+                }
+                cond_resched();
+                if (copy_from_user(&user_cmd_kernal, &cmds[i], sizeof(struct memory_container_cmd))) {
+                        ret = i ? i : -EFAULT;
+                        goto out;
+                }
+
+                switch (user_cmd_kernal.op) {
+                case MCONTAINER_OP_LOCK:
+                        result = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_LOCK, MAX_SCHEDULE_TIMEOUT);
+                        break;
+                case MCONTAINER_OP_UNLOCK:
+                        result = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_UNLOCK, MAX_SCHEDULE_TIMEOUT);
+                        break;
+                case MCONTAINER_OP_RDLOCK:
+                        result = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_RDLOCK, MAX_SCHEDULE_TIMEOUT);
+                        break;
+                case MCONTAINER_OP_RDUNLOCK:
+                        result = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_RDUNLOCK, MAX_SCHEDULE_TIMEOUT);
+                        break;
+                case MCONTAINER_OP_TRYLOCK:
+                        result = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_LOCK, 0);
+                        break;
+                case MCONTAINER_OP_TIMEDLOCK:
+                        result = update_lock_oid_in_container(container, user_cmd_kernal.oid, LOCK_OP_LOCK,
+                                                              lock_timeout(user_cmd_kernal.timeout));
+                        break;
+                case MCONTAINER_OP_FREE:
+                        result = free_oid_in_container(container, user_cmd_kernal.oid);
+                        break;
+                case MCONTAINER_OP_MAP:
+                        // Same as the library's mmap, the result is the address,
+                        // of the object itself if it is packed with others
+                        result = 0;
+                        if (user_cmd_kernal.value <= SMALL_OBJECT_MAX)
+                                result = small_alloc_in_container(container, user_cmd_kernal.oid, user_cmd_kernal.value);
+                        if (result >= 0) {
+                                offset = result;
+                                result = (long)vm_mmap(filp, 0, user_cmd_kernal.value, PROT_READ | PROT_WRITE,
+                                                       MAP_SHARED, user_cmd_kernal.oid << PAGE_SHIFT);
+                                if (!IS_ERR_VALUE(result))
+                                        result += offset;
+                        }
+                        break;
+                default:
+                        result = -EINVAL;
+                }
+                // The batch is not restarted, a signal shows as EINTR
+                if (result == -ERESTARTSYS)
+                        result = -EINTR;
+
+                if (put_user(result, &results[i])) {
+                        ret = i ? i : -EFAULT;
+                        goto out;
+                }
+
+                // A signal ends the batch, the caller sees how far it got
+                if (result == -EINTR) {
+                        ret = i + 1;
+                        goto out;
+                }
+        }
+        ret = i;
+out:
+        put_container(container);
+        return ret;
+}
+
+int memory_container_open(struct inode *inode, struct file *filp)
+{
+        struct mcontainer_file *file;
+
+        file = kmalloc(sizeof(struct mcontainer_file), GFP_KERNEL);
+        if (file == NULL)
+                return -ENOMEM;
+        INIT_LIST_HEAD(&file->tasks);
+        filp->private_data = file;
+        return 0;
+}
+
+// The task exited or is exiting, it will not release its locks itself
+static bool task_gone(struct pid_node *pid_ptr){
+
+        struct task_struct *task;
+        bool gone;
+
+        rcu_read_lock();
+        task = pid_task(pid_ptr->task, PIDTYPE_PID);
+        gone = task == NULL || (task->flags & PF_EXITING);
+        rcu_read_unlock();
+        return gone;
+}
+
+// Tasks of the file leave their containers, only those that are gone when
+// only_gone is set. The locks they still hold are released so that
+// waiters do not hang.
+static void leave_file_tasks(struct mcontainer_file *file, bool only_gone){
+
+        struct pid_node *pid_ptr, *tmp;
+        LIST_HEAD(leaving);
+
+        mutex_lock(&task_table_lock);
+        list_for_each_entry_safe(pid_ptr, tmp, &file->tasks, file_node) {
+                if (only_gone && !task_gone(pid_ptr))
+                        continue;
+                hash_del_rcu(&pid_ptr->hnode);
+                list_move(&pid_ptr->file_node, &leaving);
+        }
+        mutex_unlock(&task_table_lock);
+
+        list_for_each_entry_safe(pid_ptr, tmp, &leaving, file_node) {
+                // printk("Releasing PID: %d from CID: %llu\n", pid_ptr->pid, pid_ptr->container->cid);
+                release_locks_of_task(pid_ptr->container, pid_ptr->tid);
+                release_ranges_of_task(pid_ptr->container, pid_ptr->tid);
+                release_holds_of_task(pid_ptr);
+                free_pid_node(pid_ptr);
+        }
+}
+
+/**
+ * Every close of the file, and the exit of every process that has it open.
+ * Tasks that crashed or exited without deleting themselves leave their
+ * containers here, the file itself may stay open in other processes.
+ */
+int memory_container_flush(struct file *filp, fl_owner_t id)
+{
+        leave_file_tasks(filp->private_data, true);
+        return 0;
+}
+
+/**
+ * Last close of the file, every task left in it leaves its container.
+ */
+int memory_container_release(struct inode *inode, struct file *filp)
+{
+        struct mcontainer_file *file = filp->private_data;
+
+        leave_file_tasks(file, false);
+        kfree(file);
+        return 0;
+}
 
 /**
  * control function that receive the command in user space and pass arguments to
  * corresponding functions.
  */
-int memory_container_ioctl(struct file *filp, unsigned int cmd,
+long memory_container_ioctl(struct file *filp, unsigned int cmd,
                            unsigned long arg)
 {
         switch (cmd)
         {
         case MCONTAINER_IOCTL_CREATE:
-                return memory_container_create((void __user *)arg);
+                return memory_container_create(filp, (void __user *)arg);
         case MCONTAINER_IOCTL_DELETE:
                 return memory_container_delete((void __user *)arg);
         case MCONTAINER_IOCTL_LOCK:
                 return memory_container_lock((void __user *)arg);
         case MCONTAINER_IOCTL_UNLOCK:
                 return memory_container_unlock((void __user *)arg);
+        case MCONTAINER_IOCTL_TRYLOCK:
+                return memory_container_trylock((void __user *)arg);
+        case MCONTAINER_IOCTL_TIMEDLOCK:
+                return memory_container_timedlock((void __user *)arg);
+        case MCONTAINER_IOCTL_RDLOCK:
+                return memory_container_rdlock((void __user *)arg);
+        case MCONTAINER_IOCTL_RDUNLOCK:
+                return memory_container_rdunlock((void __user *)arg);
         case MCONTAINER_IOCTL_FREE:
                 return memory_container_free((void __user *)arg);
+        case MCONTAINER_IOCTL_SET_CONTAINER_ATTR:
+                return memory_container_set_container_attr((void __user *)arg);
+        case MCONTAINER_IOCTL_SET_OBJECT_ATTR:
+                return memory_container_set_object_attr((void __user *)arg);
+        case MCONTAINER_IOCTL_BATCH:
+                return memory_container_batch(filp, (void __user *)arg);
+        case MCONTAINER_IOCTL_SMALL_ALLOC:
+                return memory_container_small_alloc((void __user *)arg);
+        case MCONTAINER_IOCTL_GET_STATS:
+                return memory_container_get_stats((void __user *)arg);
+        case MCONTAINER_IOCTL_SET_LIMIT:
+                return memory_container_set_limit((void __user *)arg);
+        case MCONTAINER_IOCTL_LOCK_RANGE:
+                return memory_container_lock_range((void __user *)arg);
+        case MCONTAINER_IOCTL_UNLOCK_RANGE:
+                return memory_container_unlock_range((void __user *)arg);
+        case MCONTAINER_IOCTL_GET_CONTAINER_ATTR:
+                return memory_container_get_container_attr((void __user *)arg);
         default:
                 return -ENOTTY;
         }
@@ -31,6 +31,579 @@
 
 #include "mcontainer.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+// Objects whose lock words the library maps, locks of higher OIDs always go
+// through the kernel
+#define MCONTAINER_HEADER_WINDOW (1ULL << 20)
+
+// Header pages of the current container, mapped on first use
+static pthread_mutex_t header_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct memory_container_header *headers = NULL;
+static int header_fd = -1;
+
+// Mappings handed out by mcontainer_alloc(), kept until the object is freed
+// or the least recently used one is evicted. An evicted mapping is unmapped,
+// so the cache bounds how many mappings a task holds. MCONTAINER_MAP_CACHE
+// overrides how many are kept, 0 turns the cache off.
+#define MCONTAINER_MAP_BUCKETS 4096
+#define MCONTAINER_MAP_CACHE_DEFAULT 8192
+
+struct map_entry
+{
+    int devfd;
+    __u64 oid;
+    __u64 size;
+    void *addr;
+    int offset;
+    __u32 generation;
+    struct map_entry *hnext;
+    struct map_entry *prev, *next;
+};
+
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct map_entry *map_buckets[MCONTAINER_MAP_BUCKETS];
+static struct map_entry map_lru = {.prev = &map_lru, .next = &map_lru};
+static long map_capacity = -1;
+static long map_entries = 0;
+
+// MCONTAINER_ATTR_SMALL_OBJECTS of the current container, read when the task
+// joins it and kept up to date by mcontainer_set_container_attr()
+static int container_small = 0;
+
+// Arena of the current container, see mcontainer_arena_map()
+static int arena_fd = -1;
+static char *arena = NULL;
+static __u64 arena_size = 0;
+static unsigned int arena_shift = 0;
+
+// Per-call latency histograms, recorded when MCONTAINER_LATENCY is set. Its
+// value names the file a summary line per call is appended to at exit and on
+// SIGUSR2, an empty value or "-" means stderr. Every thread records into
+// histograms of its own, allocated for each call it makes, the summary adds
+// them up.
+enum latency_call
+{
+    LATENCY_ALLOC,
+    LATENCY_LOCK,
+    LATENCY_UNLOCK,
+    LATENCY_TRYLOCK,
+    LATENCY_TIMEDLOCK,
+    LATENCY_RDLOCK,
+    LATENCY_RDUNLOCK,
+    LATENCY_LOCK_RANGE,
+    LATENCY_UNLOCK_RANGE,
+    LATENCY_FREE,
+    LATENCY_BATCH,
+    LATENCY_CALLS
+};
+
+static const char *latency_names[LATENCY_CALLS] = {
+    "alloc", "lock", "unlock", "trylock", "timedlock", "rdlock", "rdunlock", "lock_range", "unlock_range",
+    "free", "batch"};
+
+// Log-linear buckets: below 2 * LATENCY_SUB ns every value has a bucket of
+// its own, above that every power of two is split into LATENCY_SUB buckets,
+// about 6% wide. Values of 2^LATENCY_MAX_BITS ns and more share the last one.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+struct latency_hist
+{
+    __u64 count;
+    __u64 max;
+    __u64 buckets[LATENCY_BUCKETS];
+};
+
+struct latency_thread
+{
+    struct latency_thread *next;
+    struct latency_hist *hist[LATENCY_CALLS];
+};
+
+struct latency_scope
+{
+    enum latency_call call;
+    __u64 start;
+};
+
+static int latency_enabled = 0;
+static int latency_fd = -1;
+// Histograms of all threads, only ever pushed to, and those of this thread
+static struct latency_thread *latency_threads = NULL;
+static __thread struct latency_thread *latency_self = NULL;
+// Scratch space of latency_dump(), which must not allocate in a signal handler
+static __u64 latency_merged[LATENCY_BUCKETS];
+static char latency_line[512];
+
+static __u64 latency_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int latency_bucket(__u64 ns)
+{
+    unsigned int shift;
+
+    if (ns < 2 * LATENCY_SUB)
+        return ns;
+    if (ns >> LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+    shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+    return shift * LATENCY_SUB + (ns >> shift);
+}
+
+/**
+ * returns the highest value that falls into a bucket.
+ */
+static __u64 latency_value(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < 2 * LATENCY_SUB)
+        return bucket;
+    shift = bucket / LATENCY_SUB - 1;
+    return ((__u64)(bucket - shift * LATENCY_SUB + 1) << shift) - 1;
+}
+
+/**
+ * the owning thread is the only writer, readers may see a count a little late.
+ */
+static void latency_add(__u64 *counter, __u64 n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static struct latency_scope latency_begin(enum latency_call call)
+{
+    struct latency_scope scope = {call, latency_enabled ? latency_now() : 0};
+    return scope;
+}
+
+static void latency_end(struct latency_scope *scope)
+{
+    struct latency_hist *hist;
+    __u64 ns;
+
+    if (scope->start == 0)
+        return;
+    ns = latency_now() - scope->start;
+
+    // the first call of a thread sets up its list entry, the first call of
+    // each kind its histogram. Without memory the call is not recorded.
+    if (latency_self == NULL)
+    {
+        latency_self = calloc(1, sizeof(struct latency_thread));
+        if (latency_self == NULL)
+            return;
+        latency_self->next = __atomic_load_n(&latency_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&latency_threads, &latency_self->next, latency_self, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    hist = latency_self->hist[scope->call];
+    if (hist == NULL)
+    {
+        hist = calloc(1, sizeof(struct latency_hist));
+        if (hist == NULL)
+            return;
+        __atomic_store_n(&latency_self->hist[scope->call], hist, __ATOMIC_RELEASE);
+    }
+    latency_add(&hist->buckets[latency_bucket(ns)], 1);
+    latency_add(&hist->count, 1);
+    if (ns > hist->max)
+        __atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+}
+
+// Declared first in an API call, records its latency on every return path
+#define LATENCY_SCOPE(call) \
+    struct latency_scope latency_scope __attribute__((cleanup(latency_end))) = latency_begin(call)
+
+static int latency_append(int len, const char *str)
+{
+    while (*str != '\0' && len < (int)sizeof(latency_line) - 1)
+        latency_line[len++] = *str++;
+    return len;
+}
+
+static int latency_append_u64(int len, __u64 value)
+{
+    char digits[24];
+    int n = sizeof(digits) - 1;
+
+    digits[n] = '\0';
+    do
+    {
+        digits[--n] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    return latency_append(len, digits + n);
+}
+
+/**
+ * returns the value below which per_mille of the recorded calls fall.
+ */
+static __u64 latency_percentile(__u64 count, __u64 max, unsigned int per_mille)
+{
+    __u64 target = (count * per_mille + 999) / 1000, seen = 0;
+    unsigned int bucket;
+
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        seen += latency_merged[bucket];
+        if (seen >= target)
+            break;
+    }
+    return latency_value(bucket) < max ? latency_value(bucket) : max;
+}
+
+/**
+ * writes a line per call that was made, as key=value pairs. Only uses what
+ * is safe in a signal handler.
+ */
+static void latency_dump(void)
+{
+    struct latency_thread *thread;
+    struct latency_hist *hist;
+    __u64 count, max;
+    unsigned int bucket;
+    int call, len;
+
+    if (!latency_enabled)
+        return;
+    for (call = 0; call < LATENCY_CALLS; call++)
+    {
+        memset(latency_merged, 0, sizeof(latency_merged));
+        count = 0;
+        max = 0;
+        for (thread = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE); thread != NULL; thread = thread->next)
+        {
+            hist = __atomic_load_n(&thread->hist[call], __ATOMIC_ACQUIRE);
+            if (hist == NULL)
+                continue;
+            for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+                latency_merged[bucket] += __atomic_load_n(&hist->buckets[bucket], __ATOMIC_RELAXED);
+            count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+            if (__atomic_load_n(&hist->max, __ATOMIC_RELAXED) > max)
+                max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+        }
+        if (count == 0)
+            continue;
+
+        len = latency_append(0, "mcontainer_latency pid=");
+        len = latency_append_u64(len, getpid());
+        len = latency_append(len, " call=");
+        len = latency_append(len, latency_names[call]);
+        len = latency_append(len, " count=");
+        len = latency_append_u64(len, count);
+        len = latency_append(len, " p50_ns=");
+        len = latency_append_u64(len, latency_percentile(count, max, 500));
+        len = latency_append(len, " p99_ns=");
+        len = latency_append_u64(len, latency_percentile(count, max, 990));
+        len = latency_append(len, " p999_ns=");
+        len = latency_append_u64(len, latency_percentile(count, max, 999));
+        len = latency_append(len, " max_ns=");
+        len = latency_append_u64(len, max);
+        len = latency_append(len, "\n");
+        if (write(latency_fd, latency_line, len) < 0)
+            return;
+    }
+}
+
+static void latency_signal(int sig)
+{
+    int saved_errno = errno;
+
+    (void)sig;
+    latency_dump();
+    errno = saved_errno;
+}
+
+/**
+ * a forked child starts with empty histograms, the parent reports its own.
+ */
+static void latency_reset(void)
+{
+    latency_threads = NULL;
+    latency_self = NULL;
+}
+
+static void latency_init(void)
+{
+    struct sigaction action, old;
+    char *env = getenv("MCONTAINER_LATENCY");
+
+    if (env == NULL)
+        return;
+    if (env[0] == '\0' || strcmp(env, "-") == 0)
+        latency_fd = STDERR_FILENO;
+    else
+        latency_fd = open(env, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (latency_fd < 0)
+        return;
+    latency_enabled = 1;
+    pthread_atfork(NULL, NULL, latency_reset);
+    atexit(latency_dump);
+
+    // the application's own SIGUSR2 handler wins
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = latency_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR2, NULL, &old) == 0 && old.sa_handler == SIG_DFL)
+        sigaction(SIGUSR2, &action, NULL);
+}
+
+// Thread id stored in the lock words, reset in a forked child
+static __thread __u32 cached_tid = 0;
+
+static void reset_tid(void)
+{
+    cached_tid = 0;
+}
+
+// Hold log of this thread, see struct memory_container_holds. Mapped with the
+// first shared lock, MAP_FAILED when that failed. Slots from holds_top on are
+// free. A forked child does not inherit the mapping and maps its own.
+static __thread struct memory_container_holds *holds = NULL;
+static __thread int holds_top = 0;
+
+static void reset_holds(void)
+{
+    holds = NULL;
+    holds_top = 0;
+}
+
+static void __attribute__((constructor)) mcontainer_init(void)
+{
+    pthread_atfork(NULL, NULL, reset_tid);
+    pthread_atfork(NULL, NULL, reset_holds);
+    latency_init();
+}
+
+static __u32 current_tid(void)
+{
+    if (cached_tid == 0)
+        cached_tid = syscall(SYS_gettid) & MCONTAINER_LOCK_OWNER_MASK;
+    return cached_tid;
+}
+
+/**
+ * logs a shared hold of this thread, the kernel releases it if the thread
+ * dies before mcontainer_rdunlock(). Holds past MCONTAINER_HOLDS_MAX are not
+ * logged.
+ */
+static void hold_add(int devfd, __u64 offset)
+{
+    int i;
+
+    if (holds == NULL)
+        holds = mmap(0, sizeof(struct memory_container_holds), PROT_READ | PROT_WRITE, MAP_SHARED, devfd,
+                     MCONTAINER_MMAP_HOLDS * getpagesize());
+    if (holds == MAP_FAILED)
+        return;
+    for (i = 0; i < holds_top; i++)
+    {
+        if (holds->oid[i] == 0)
+            break;
+    }
+    if (i == MCONTAINER_HOLDS_MAX)
+        return;
+    holds->oid[i] = offset + 1;
+    if (i == holds_top)
+        holds_top++;
+}
+
+static void hold_remove(__u64 offset)
+{
+    int i;
+
+    if (holds == NULL || holds == MAP_FAILED)
+        return;
+    for (i = holds_top - 1; i >= 0; i--)
+    {
+        if (holds->oid[i] == offset + 1)
+        {
+            holds->oid[i] = 0;
+            break;
+        }
+    }
+    while (holds_top > 0 && holds->oid[holds_top - 1] == 0)
+        holds_top--;
+}
+
+/**
+ * the hold log belongs to the container the thread leaves.
+ */
+static void unmap_holds(void)
+{
+    if (holds != NULL && holds != MAP_FAILED)
+        munmap(holds, sizeof(struct memory_container_holds));
+    reset_holds();
+}
+
+/**
+ * returns the header of an object in the mapped header pages, or NULL when
+ * it lies outside the window or the pages could not be mapped.
+ */
+static struct memory_container_header *header_slot(int devfd, __u64 offset)
+{
+    struct memory_container_header *map;
+
+    if (offset >= MCONTAINER_HEADER_WINDOW)
+        return NULL;
+
+    map = __atomic_load_n(&headers, __ATOMIC_ACQUIRE);
+    if (map == NULL)
+    {
+        pthread_mutex_lock(&header_lock);
+        if (headers == NULL)
+        {
+            // a failed mapping is remembered, locks then always use the kernel
+            header_fd = devfd;
+            __atomic_store_n(&headers, mmap(0, MCONTAINER_HEADER_WINDOW * sizeof(struct memory_container_header),
+                                            PROT_READ | PROT_WRITE, MAP_SHARED, devfd,
+                                            MCONTAINER_MMAP_HEADER * getpagesize()), __ATOMIC_RELEASE);
+        }
+        map = headers;
+        pthread_mutex_unlock(&header_lock);
+    }
+
+    if (map == MAP_FAILED || header_fd != devfd)
+        return NULL;
+    return &map[offset];
+}
+
+/**
+ * returns the lock word of an object, or NULL when the lock has to be taken
+ * through the kernel.
+ */
+static __u32 *lock_word(int devfd, __u64 offset)
+{
+    struct memory_container_header *header = header_slot(devfd, offset);
+    return header != NULL ? &header->lock : NULL;
+}
+
+/**
+ * a writer of an object with MCONTAINER_HEADER_SEQLOCK makes its sequence
+ * count odd right after taking the lock, and even again right before
+ * dropping it. The kernel does the same when the lock goes through it.
+ */
+static void seq_write_begin(__u32 *word)
+{
+    struct memory_container_header *header =
+        (struct memory_container_header *)((char *)word - offsetof(struct memory_container_header, lock));
+
+    if (!(__atomic_load_n(&header->flags, __ATOMIC_RELAXED) & MCONTAINER_HEADER_SEQLOCK))
+        return;
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+    // the object is written only after the count turned odd
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void seq_write_end(__u32 *word)
+{
+    struct memory_container_header *header =
+        (struct memory_container_header *)((char *)word - offsetof(struct memory_container_header, lock));
+
+    if (!(__atomic_load_n(&header->flags, __ATOMIC_RELAXED) & MCONTAINER_HEADER_SEQLOCK))
+        return;
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
+
+static struct map_entry **map_bucket(int devfd, __u64 oid)
+{
+    return &map_buckets[((oid * 0x9e3779b97f4a7c15ULL) >> 40 ^ devfd) % MCONTAINER_MAP_BUCKETS];
+}
+
+/**
+ * forgets a cached mapping without unmapping it, called with map_lock held.
+ */
+static void map_forget(struct map_entry *entry)
+{
+    struct map_entry **link = map_bucket(entry->devfd, entry->oid);
+
+    while (*link != entry)
+        link = &(*link)->hnext;
+    *link = entry->hnext;
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    free(entry);
+    map_entries--;
+}
+
+/**
+ * unmaps a cached mapping and forgets it, called with map_lock held.
+ */
+static void map_drop(struct map_entry *entry)
+{
+    void *addr = entry->addr;
+    __u64 size = entry->size;
+
+    map_forget(entry);
+    munmap(addr, size);
+}
+
+/**
+ * forgets the mappings of one object, or of every object when devfd is -1.
+ */
+static void map_invalidate(int devfd, __u64 oid)
+{
+    struct map_entry *entry, *next;
+
+    pthread_mutex_lock(&map_lock);
+    if (devfd == -1)
+    {
+        for (entry = map_lru.next; entry != &map_lru; entry = next)
+        {
+            next = entry->next;
+            map_drop(entry);
+        }
+    }
+    else
+    {
+        for (entry = *map_bucket(devfd, oid); entry != NULL; entry = entry->hnext)
+        {
+            if (entry->devfd == devfd && entry->oid == oid)
+            {
+                map_drop(entry);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&map_lock);
+}
+
+/**
+ * drops the header and arena mappings when the task changes container.
+ */
+static void unmap_headers(void)
+{
+    pthread_mutex_lock(&header_lock);
+    if (headers != NULL && headers != MAP_FAILED)
+        munmap(headers, MCONTAINER_HEADER_WINDOW * sizeof(struct memory_container_header));
+    __atomic_store_n(&headers, NULL, __ATOMIC_RELEASE);
+    header_fd = -1;
+    if (arena != NULL)
+        munmap(arena, arena_size);
+    arena_fd = -1;
+    arena = NULL;
+    arena_size = 0;
+    pthread_mutex_unlock(&header_lock);
+}
+
 /**
  * delete function in user space that sends command to kernel space
  * for deleting the current task in specified container.
@@ -38,7 +611,15 @@
 int mcontainer_delete(int devfd)
 {
     struct memory_container_cmd cmd;
-    return ioctl(devfd, MCONTAINER_IOCTL_DELETE, &cmd);
+    int ret;
+
+    map_invalidate(-1, 0);
+    unmap_headers();
+    container_small = 0;
+    // the kernel drops the shared locks still logged as it lets the task go
+    ret = ioctl(devfd, MCONTAINER_IOCTL_DELETE, &cmd);
+    unmap_holds();
+    return ret;
 }
 
 /**
@@ -48,45 +629,497 @@ int mcontainer_delete(int devfd)
 int mcontainer_create(int devfd, int cid)
 {
     struct memory_container_cmd cmd;
+    int ret;
+
     cmd.cid = cid;
-    return ioctl(devfd, MCONTAINER_IOCTL_CREATE, &cmd);
+    map_invalidate(-1, 0);
+    unmap_headers();
+    unmap_holds();
+    ret = ioctl(devfd, MCONTAINER_IOCTL_CREATE, &cmd);
+    if (ret < 0)
+        return ret;
+
+    // a module without the attribute never packs objects
+    cmd.op = MCONTAINER_ATTR_SMALL_OBJECTS;
+    container_small = ioctl(devfd, MCONTAINER_IOCTL_GET_CONTAINER_ATTR, &cmd) > 0;
+    return ret;
 }
 
 /**
  * Allocate memory in kernel space for sharing along with tasks in the same container.
+ * Repeated calls for the same object return the cached mapping, which stays
+ * valid until the object is freed, a larger size is asked for or it is
+ * evicted. When the cache is full the least recently used mapping is
+ * unmapped, so a pointer is only good until MCONTAINER_MAP_CACHE other
+ * objects have been asked for since; the next call for its object maps it
+ * again. Only objects inside
+ * the header window are cached, outside of it a free by another task could
+ * not be noticed. Objects of up to half a page are
+ * packed with others when the container has MCONTAINER_ATTR_SMALL_OBJECTS set.
  */
 void *mcontainer_alloc(int devfd, __u64 offset, __u64 size)
 {
+    LATENCY_SCOPE(LATENCY_ALLOC);
     __u64 aligned_size = ((size + getpagesize() - 1) / getpagesize()) * getpagesize();
-    return mmap(0, aligned_size, PROT_READ | PROT_WRITE, MAP_SHARED, devfd, offset * getpagesize());
+    struct memory_container_header *header = header_slot(devfd, offset);
+    __u32 generation = header != NULL ? __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE) : 0;
+    struct map_entry *entry, **bucket;
+    struct memory_container_cmd cmd;
+    int in_page = 0;
+    char *env;
+    void *addr;
+
+    pthread_mutex_lock(&map_lock);
+    if (map_capacity < 0)
+    {
+        env = getenv("MCONTAINER_MAP_CACHE");
+        map_capacity = env != NULL ? atol(env) : MCONTAINER_MAP_CACHE_DEFAULT;
+    }
+
+    bucket = map_bucket(devfd, offset);
+    for (entry = *bucket; entry != NULL; entry = entry->hnext)
+    {
+        if (entry->devfd == devfd && entry->oid == offset)
+            break;
+    }
+    if (entry != NULL)
+    {
+        // a free by any task bumps the generation, the mapping is stale then
+        if (entry->size >= aligned_size && entry->generation == generation)
+        {
+            entry->prev->next = entry->next;
+            entry->next->prev = entry->prev;
+            entry->next = map_lru.next;
+            entry->prev = &map_lru;
+            map_lru.next->prev = entry;
+            map_lru.next = entry;
+            pthread_mutex_unlock(&map_lock);
+            return (char *)entry->addr + entry->offset;
+        }
+        map_drop(entry);
+    }
+
+    // a packed object shows its place in its header, a new small one is
+    // placed by the kernel when the container packs objects
+    if (header != NULL && (__atomic_load_n(&header->flags, __ATOMIC_ACQUIRE) & MCONTAINER_HEADER_PACKED))
+    {
+        in_page = header->offset;
+    }
+    else if (container_small && size <= (__u64)getpagesize() / 2)
+    {
+        cmd.oid = offset;
+        cmd.value = size;
+        in_page = ioctl(devfd, MCONTAINER_IOCTL_SMALL_ALLOC, &cmd);
+        if (in_page < 0)
+        {
+            pthread_mutex_unlock(&map_lock);
+            return MAP_FAILED;
+        }
+    }
+
+    // mmap takes mmap_lock for writing anyway, holding map_lock costs nothing
+    addr = mmap(0, aligned_size, PROT_READ | PROT_WRITE, MAP_SHARED, devfd, offset * getpagesize());
+    if (addr != MAP_FAILED && header != NULL && map_capacity > 0 && (entry = malloc(sizeof(struct map_entry))) != NULL)
+    {
+        if (map_entries >= map_capacity)
+            map_drop(map_lru.prev);
+        entry->devfd = devfd;
+        entry->oid = offset;
+        entry->size = aligned_size;
+        entry->addr = addr;
+        entry->offset = in_page;
+        entry->generation = generation;
+        entry->hnext = *bucket;
+        *bucket = entry;
+        entry->next = map_lru.next;
+        entry->prev = &map_lru;
+        map_lru.next->prev = entry;
+        map_lru.next = entry;
+        map_entries++;
+    }
+    pthread_mutex_unlock(&map_lock);
+    return addr == MAP_FAILED ? addr : (char *)addr + in_page;
 }
 
 /**
- * Lock a memory page
+ * Map the first nr_objects objects of the current container as one region,
+ * each in a slot of object_size rounded up to a power of two pages. Objects
+ * are created on first touch, mcontainer_arena_ptr() finds them afterwards.
+ */
+void *mcontainer_arena_map(int devfd, __u64 nr_objects, __u64 object_size)
+{
+    unsigned int order = 0;
+    __u64 size;
+    void *addr;
+
+    while (((__u64)getpagesize() << order) < object_size)
+        order++;
+    size = nr_objects << order;
+    addr = mmap(0, size * getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED, devfd,
+                (MCONTAINER_MMAP_ARENA | ((__u64)order << MCONTAINER_ARENA_ORDER_SHIFT)) * getpagesize());
+    if (addr == MAP_FAILED)
+        return addr;
+
+    pthread_mutex_lock(&header_lock);
+    if (arena != NULL)
+        munmap(arena, arena_size);
+    arena_fd = devfd;
+    arena = addr;
+    arena_size = size * getpagesize();
+    arena_shift = order + __builtin_ctz(getpagesize());
+    pthread_mutex_unlock(&header_lock);
+    return addr;
+}
+
+/**
+ * returns the address of an object in the arena, or NULL when it lies
+ * outside of the arena. A packed object sits at its offset in the first page
+ * of its slot.
+ */
+void *mcontainer_arena_ptr(__u64 offset)
+{
+    struct memory_container_header *header;
+
+    if (arena == NULL || offset >= arena_size >> arena_shift)
+        return NULL;
+    header = header_slot(arena_fd, offset);
+    if (header != NULL && (__atomic_load_n(&header->flags, __ATOMIC_ACQUIRE) & MCONTAINER_HEADER_PACKED))
+        return arena + (offset << arena_shift) + header->offset;
+    return arena + (offset << arena_shift);
+}
+
+/**
+ * Lock a memory page, without a system call unless someone else holds it
  */
 int mcontainer_lock(int devfd, __u64 offset)
 {
+    LATENCY_SCOPE(LATENCY_LOCK);
     struct memory_container_cmd cmd;
+    __u32 *word = lock_word(devfd, offset);
+    __u32 expected = 0;
+
+    if (word != NULL && __atomic_compare_exchange_n(word, &expected, current_tid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        seq_write_begin(word);
+        return 0;
+    }
+
     cmd.oid = offset;
     return ioctl(devfd, MCONTAINER_IOCTL_LOCK, &cmd);
 }
 
 /**
- * Unlock a memory page
+ * Unlock a memory page, the kernel is only entered to wake waiters
  */
 int mcontainer_unlock(int devfd, __u64 offset)
 {
+    LATENCY_SCOPE(LATENCY_UNLOCK);
     struct memory_container_cmd cmd;
+    __u32 *word = lock_word(devfd, offset);
+    __u32 expected = current_tid();
+
+    if (word != NULL && __atomic_load_n(word, __ATOMIC_RELAXED) == expected)
+    {
+        seq_write_end(word);
+        if (__atomic_compare_exchange_n(word, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return 0;
+        // a waiter came in, the write is ended again by the kernel
+        seq_write_begin(word);
+    }
+
     cmd.oid = offset;
     return ioctl(devfd, MCONTAINER_IOCTL_UNLOCK, &cmd);
 }
 
+/**
+ * Lock a memory page only if nobody holds it, fails with EBUSY otherwise
+ */
+int mcontainer_trylock(int devfd, __u64 offset)
+{
+    LATENCY_SCOPE(LATENCY_TRYLOCK);
+    struct memory_container_cmd cmd;
+    __u32 *word = lock_word(devfd, offset);
+    __u32 expected = 0;
+
+    if (word != NULL)
+    {
+        if (__atomic_compare_exchange_n(word, &expected, current_tid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            seq_write_begin(word);
+            return 0;
+        }
+        // a held lock is answered without a system call
+        if (expected & MCONTAINER_LOCK_OWNER_MASK)
+        {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    cmd.oid = offset;
+    return ioctl(devfd, MCONTAINER_IOCTL_TRYLOCK, &cmd);
+}
+
+/**
+ * Lock a memory page, waiting at most timeout_ns nanoseconds. Fails with
+ * ETIMEDOUT when the lock stayed busy and EINTR when a signal arrived.
+ */
+int mcontainer_timedlock(int devfd, __u64 offset, __u64 timeout_ns)
+{
+    LATENCY_SCOPE(LATENCY_TIMEDLOCK);
+    struct memory_container_cmd cmd;
+    __u32 *word = lock_word(devfd, offset);
+    __u32 expected = 0;
+
+    if (word != NULL && __atomic_compare_exchange_n(word, &expected, current_tid(), 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        seq_write_begin(word);
+        return 0;
+    }
+
+    cmd.oid = offset;
+    cmd.timeout = timeout_ns;
+    return ioctl(devfd, MCONTAINER_IOCTL_TIMEDLOCK, &cmd);
+}
+
+/**
+ * Lock a memory page shared with other readers, the kernel is only entered
+ * while a writer holds the lock or waits for it. The hold is logged so that
+ * it is released if the thread dies.
+ */
+int mcontainer_rdlock(int devfd, __u64 offset)
+{
+    LATENCY_SCOPE(LATENCY_RDLOCK);
+    struct memory_container_cmd cmd;
+    __u32 *word = lock_word(devfd, offset);
+    __u32 expected;
+    int ret;
+
+    if (word != NULL)
+    {
+        expected = __atomic_load_n(word, __ATOMIC_RELAXED);
+        while (!(expected & (MCONTAINER_LOCK_WAITERS | MCONTAINER_LOCK_WRITER_WAITING)) &&
+               (expected == 0 || (expected & MCONTAINER_LOCK_SHARED)) &&
+               (expected & MCONTAINER_LOCK_OWNER_MASK) != MCONTAINER_LOCK_OWNER_MASK)
+        {
+            if (__atomic_compare_exchange_n(word, &expected, (expected | MCONTAINER_LOCK_SHARED) + 1, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                hold_add(devfd, offset);
+                return 0;
+            }
+        }
+    }
+
+    cmd.oid = offset;
+    ret = ioctl(devfd, MCONTAINER_IOCTL_RDLOCK, &cmd);
+    if (ret == 0)
+        hold_add(devfd, offset);
+    return ret;
+}
+
+/**
+ * Drop a shared lock, the last reader enters the kernel only to wake waiters
+ */
+int mcontainer_rdunlock(int devfd, __u64 offset)
+{
+    LATENCY_SCOPE(LATENCY_RDUNLOCK);
+    struct memory_container_cmd cmd;
+    __u32 *word = lock_word(devfd, offset);
+    __u32 expected, new;
+
+    hold_remove(offset);
+    if (word != NULL)
+    {
+        expected = __atomic_load_n(word, __ATOMIC_RELAXED);
+        while ((expected & MCONTAINER_LOCK_SHARED) && (expected & MCONTAINER_LOCK_OWNER_MASK))
+        {
+            new = expected - 1;
+            if (!(new & MCONTAINER_LOCK_OWNER_MASK))
+            {
+                if (new & MCONTAINER_LOCK_WAITERS)
+                    break;
+                new &= ~MCONTAINER_LOCK_SHARED;
+            }
+            if (__atomic_compare_exchange_n(word, &expected, new, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                return 0;
+        }
+    }
+
+    cmd.oid = offset;
+    return ioctl(devfd, MCONTAINER_IOCTL_RDUNLOCK, &cmd);
+}
+
+/**
+ * locks length bytes of an object from byte off, other threads can lock ranges
+ * of the same object that do not overlap at the same time. Always enters the
+ * kernel. A whole-object lock waits for all ranges, do not hold one while
+ * locking another range of the same object. Objects read with
+ * mcontainer_read_begin() have no ranges, the call fails with EINVAL.
+ */
+int mcontainer_lock_range(int devfd, __u64 offset, __u64 off, __u64 len)
+{
+    LATENCY_SCOPE(LATENCY_LOCK_RANGE);
+    struct memory_container_range range;
+    range.oid = offset;
+    range.offset = off;
+    range.length = len;
+    return ioctl(devfd, MCONTAINER_IOCTL_LOCK_RANGE, &range);
+}
+
+/**
+ * unlocks a range taken with mcontainer_lock_range(), off and len have to match
+ * it exactly.
+ */
+int mcontainer_unlock_range(int devfd, __u64 offset, __u64 off, __u64 len)
+{
+    LATENCY_SCOPE(LATENCY_UNLOCK_RANGE);
+    struct memory_container_range range;
+    range.oid = offset;
+    range.offset = off;
+    range.length = len;
+    return ioctl(devfd, MCONTAINER_IOCTL_UNLOCK_RANGE, &range);
+}
+
+/**
+ * starts an optimistic read of an object with MCONTAINER_ATTR_SEQLOCK set,
+ * without a lock or a system call. Copy the object, then pass seq to
+ * mcontainer_read_retry() and copy it again while that returns 1. Fails with
+ * EINVAL when the object keeps no sequence count.
+ */
+int mcontainer_read_begin(int devfd, __u64 offset, __u32 *seq)
+{
+    struct memory_container_header *header = header_slot(devfd, offset);
+    unsigned int spins = 0;
+    __u32 value;
+
+    if (header == NULL || !(__atomic_load_n(&header->flags, __ATOMIC_RELAXED) & MCONTAINER_HEADER_SEQLOCK))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    // an odd count means a writer is inside, it may take a while to leave
+    while ((value = __atomic_load_n(&header->seq, __ATOMIC_ACQUIRE)) & 1)
+    {
+        if (++spins > 100)
+            sched_yield();
+    }
+    *seq = value;
+    return 0;
+}
+
+/**
+ * returns 1 when a writer got in since mcontainer_read_begin() returned seq,
+ * the copy may be torn and has to be read again, 0 when it is consistent.
+ */
+int mcontainer_read_retry(int devfd, __u64 offset, __u32 seq)
+{
+    struct memory_container_header *header = header_slot(devfd, offset);
+
+    // the copy is complete before the count is looked at again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return header == NULL || __atomic_load_n(&header->seq, __ATOMIC_RELAXED) != seq;
+}
+
 /**
  * removes an object from memory_container
  */
 int mcontainer_free(int devfd, __u64 offset)
 {
+    LATENCY_SCOPE(LATENCY_FREE);
     struct memory_container_cmd cmd;
     cmd.oid = offset;
+    map_invalidate(devfd, offset);
     return ioctl(devfd, MCONTAINER_IOCTL_FREE, &cmd);
-}
\ No newline at end of file
+}
+
+/**
+ * sets an attribute of the current container, objects created afterwards
+ * start with it.
+ */
+int mcontainer_set_container_attr(int devfd, __u64 attr, __u64 value)
+{
+    struct memory_container_cmd cmd;
+    int ret;
+
+    cmd.op = attr;
+    cmd.value = value;
+    ret = ioctl(devfd, MCONTAINER_IOCTL_SET_CONTAINER_ATTR, &cmd);
+    if (ret == 0 && attr == MCONTAINER_ATTR_SMALL_OBJECTS)
+        container_small = value != 0;
+    return ret;
+}
+
+/**
+ * limits the objects (MCONTAINER_LIMIT_OBJECTS) or bytes (MCONTAINER_LIMIT_BYTES)
+ * of the caller's container, 0 lifts the limit. Objects past it fail with ENOMEM.
+ */
+int mcontainer_set_limit(int devfd, __u64 limit, __u64 value)
+{
+    struct memory_container_cmd cmd;
+    cmd.op = limit;
+    cmd.value = value;
+    return ioctl(devfd, MCONTAINER_IOCTL_SET_LIMIT, &cmd);
+}
+
+/**
+ * sets an attribute of a single object, must happen before it is first mapped.
+ */
+int mcontainer_set_object_attr(int devfd, __u64 offset, __u64 attr, __u64 value)
+{
+    struct memory_container_cmd cmd;
+    cmd.op = attr;
+    cmd.oid = offset;
+    cmd.value = value;
+    return ioctl(devfd, MCONTAINER_IOCTL_SET_OBJECT_ATTR, &cmd);
+}
+
+/**
+ * reads the module wide object and page counters.
+ */
+int mcontainer_get_stats(int devfd, struct memory_container_stats *stats)
+{
+    return ioctl(devfd, MCONTAINER_IOCTL_GET_STATS, stats);
+}
+
+/**
+ * runs count lock/unlock/free/map commands, in system calls of at most
+ * MCONTAINER_BATCH_MAX commands. results receives the return value of each
+ * command, or the address for a map. Mappings made by a batch are not
+ * cached like those of mcontainer_alloc(), the caller unmaps them. Returns
+ * the number of commands that ran.
+ */
+long mcontainer_batch(int devfd, struct memory_container_cmd *cmds, __s64 *results, __u64 count)
+{
+    LATENCY_SCOPE(LATENCY_BATCH);
+    struct memory_container_batch batch;
+    __u64 i, done = 0;
+    long ret;
+
+    for (i = 0; i < count; i++)
+    {
+        if (cmds[i].op == MCONTAINER_OP_FREE)
+            map_invalidate(devfd, cmds[i].oid);
+        else if (cmds[i].op == MCONTAINER_OP_RDUNLOCK)
+            hold_remove(cmds[i].oid);
+    }
+    while (done < count)
+    {
+        batch.count = count - done < MCONTAINER_BATCH_MAX ? count - done : MCONTAINER_BATCH_MAX;
+        batch.cmds = (__u64)(unsigned long)(cmds + done);
+        batch.results = (__u64)(unsigned long)(results + done);
+        ret = ioctl(devfd, MCONTAINER_IOCTL_BATCH, &batch);
+        if (ret < 0)
+            return done ? (long)done : ret;
+        for (i = done; i < done + ret; i++)
+        {
+            if (cmds[i].op == MCONTAINER_OP_RDLOCK && results[i] == 0)
+                hold_add(devfd, cmds[i].oid);
+        }
+        done += ret;
+        // a signal stopped the batch early
+        if ((__u64)ret < batch.count)
+            break;
+    }
+    return done;
+}
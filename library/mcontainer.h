@@ -45,9 +45,24 @@ extern "C"
     int mcontainer_delete(int devfd);
     int mcontainer_create(int devfd, int cid);
     void *mcontainer_alloc(int devfd, __u64 offset, __u64 size);
+    void *mcontainer_arena_map(int devfd, __u64 nr_objects, __u64 object_size);
+    void *mcontainer_arena_ptr(__u64 offset);
     int mcontainer_lock(int devfd, __u64 offset);
     int mcontainer_unlock(int devfd, __u64 offset);
+    int mcontainer_trylock(int devfd, __u64 offset);
+    int mcontainer_timedlock(int devfd, __u64 offset, __u64 timeout_ns);
+    int mcontainer_rdlock(int devfd, __u64 offset);
+    int mcontainer_rdunlock(int devfd, __u64 offset);
+    int mcontainer_lock_range(int devfd, __u64 offset, __u64 off, __u64 len);
+    int mcontainer_unlock_range(int devfd, __u64 offset, __u64 off, __u64 len);
+    int mcontainer_read_begin(int devfd, __u64 offset, __u32 *seq);
+    int mcontainer_read_retry(int devfd, __u64 offset, __u32 seq);
     int mcontainer_free(int devfd, __u64 offset);
+    int mcontainer_set_container_attr(int devfd, __u64 attr, __u64 value);
+    int mcontainer_set_object_attr(int devfd, __u64 offset, __u64 attr, __u64 value);
+    int mcontainer_set_limit(int devfd, __u64 limit, __u64 value);
+    int mcontainer_get_stats(int devfd, struct memory_container_stats *stats);
+    long mcontainer_batch(int devfd, struct memory_container_cmd *cmds, __s64 *results, __u64 count);
 
 #ifdef __cplusplus
 }
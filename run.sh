@@ -73,3 +73,58 @@ printf "Running ./test.sh 128 16384 8 4\n"
 printf "Running ./test.sh 128 20480 8 4\n"
 ./test.sh 128 20480 8 4
 printf "\n\n"
+
+printf "huge pages against 4 KB pages\n\n"
+printf "Running ./test.sh 16 2097152 4 1 -s 64\n"
+./test.sh 16 2097152 4 1 -s 64
+printf "Running ./test.sh 16 2097152 4 1 -H -s 64\n"
+./test.sh 16 2097152 4 1 -H -s 64
+printf "\n\n"
+
+printf "batched against one call per operation\n\n"
+printf "Running ./test.sh 1024 4096 4 1\n"
+./test.sh 1024 4096 4 1
+printf "Running ./test.sh 1024 4096 4 1 -b 32\n"
+./test.sh 1024 4096 4 1 -b 32
+printf "\n\n"
+
+printf "one arena mapping against a mapping per object\n\n"
+printf "Running ./test.sh 4096 4096 1 1 -r 50\n"
+./test.sh 4096 4096 1 1 -r 50
+printf "Running ./test.sh 4096 4096 1 1 -A -r 50\n"
+./test.sh 4096 4096 1 1 -A -r 50
+printf "\n\n"
+
+printf "small objects packed into shared pages against a page each\n\n"
+printf "Running ./test.sh 1024 1288 4 1\n"
+./test.sh 1024 1288 4 1
+printf "Running ./test.sh 1024 1288 4 1 -S\n"
+./test.sh 1024 1288 4 1 -S
+printf "\n\n"
+
+printf "read mostly against write only object accesses\n\n"
+printf "Running ./test.sh 256 4096 8 1 -r 0\n"
+./test.sh 256 4096 8 1 -r 0
+printf "Running ./test.sh 256 4096 8 1 -r 90\n"
+./test.sh 256 4096 8 1 -r 90
+printf "Running ./test.sh 256 4096 8 1 -r 90 -O\n"
+./test.sh 256 4096 8 1 -r 90 -O
+printf "\n\n"
+
+printf "first touch against interleaved placement of object pages\n\n"
+printf "Running ./test.sh 1024 65536 4 1 -N first-touch\n"
+./test.sh 1024 65536 4 1 -N first-touch
+printf "Running ./test.sh 1024 65536 4 1 -N interleave\n"
+./test.sh 1024 65536 4 1 -N interleave
+printf "\n\n"
+
+printf "throughput against fair (FIFO hand over) object locks under contention\n\n"
+printf "Running ./test.sh 128 4096 64 1 -L throughput\n"
+./test.sh 128 4096 64 1 -L throughput
+printf "Running ./test.sh 128 4096 64 1 -L fair\n"
+./test.sh 128 4096 64 1 -L fair
+printf "Running ./test.sh 128 4096 128 1 -L throughput\n"
+./test.sh 128 4096 128 1 -L throughput
+printf "Running ./test.sh 128 4096 128 1 -L fair\n"
+./test.sh 128 4096 128 1 -L fair
+printf "\n\n"
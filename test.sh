@@ -1,8 +1,8 @@
 #!/bin/bash
 
 # Parse input
-if [ $# -ne 4 ]; then
-    echo "Usage: $0 <# of objects> <max size of objects> <# of tasks> <# of containers>"
+if [ $# -lt 4 ]; then
+    echo "Usage: $0 <# of objects> <max size of objects> <# of tasks> <# of containers> [benchmark options]"
     exit
 fi
 
@@ -12,9 +12,11 @@ number_of_processes=$3
 number_of_containers=$4
 
 sudo dmesg -C
-sudo insmod kernel_module/memory_container.ko
+# validate reads the objects back after every benchmark task has left, so
+# containers must not be reclaimed when they empty
+sudo insmod kernel_module/memory_container.ko reclaim_empty_containers=0
 sudo chmod 777 /dev/mcontainer
-./benchmark/benchmark $1 $2 $3 $4
+./benchmark/benchmark "${@:5}" $1 $2 $3 $4
 cat *.log > trace
 sort -n -k 4 trace > sorted_trace
 ./benchmark/validate $1 $2 $4 < sorted_trace